@@ -8,16 +8,249 @@
  * @copyright Copyright (c) 2024, Warren Mann
  */
 
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "rbtree.h"
+#include "rbtree_journal.h"
 
+/**
+ * Nodes moved by compaction live in blocks of RBTREE_ARENA_SIZE bytes that
+ * are aligned to their size, so the block holding a node can be found from
+ * the node's address. A block is unmapped once its last node is freed.
+ * Blocks are mapped on their own rather than taken from the heap, so that
+ * binding one to a NUMA node doesn't affect memory malloc() hands out.
+ */
+#define RBTREE_ARENA_SIZE           65536
+
+/**
+ * Under the WAVL and AVL policies the color bit holds the parity of the
+ * node's rank. The rank difference between a node and its parent is 1 or 2,
+ * so it is 1 when their parities differ and 2 when they match. The nil node
+ * has rank -1 and so odd parity.
+ */
+#define RBTREE_RANK_DIFF(c, p)      ((((c)->flags ^ (p)->flags) & RBTREE_COLOR_MASK) ? 1 : 2)
+#define RBTREE_FLIP_RANK(n)         (n)->flags ^= RBTREE_COLOR_MASK
+
+/**
+ * The lookup cache is set associative. A key can be cached in any of the
+ * RBTREE_CACHE_WAYS entries of the set its hash selects, which are kept in
+ * order of use so the least recently used one is replaced.
+ */
+#define RBTREE_CACHE_WAYS           2
+
+/// @brief mbind() policy and flag values from <numaif.h>, which is only
+/// available with libnuma.
+#define RBTREE_MPOL_PREFERRED       1
+#define RBTREE_MPOL_MF_MOVE         (1 << 1)
+
+typedef struct arena_t {
+    /// @brief Nodes in the block that haven't been freed, plus one while the
+    /// block is still being filled.
+    unsigned long int live;
+    /// @brief Number of slots handed out.
+    unsigned long int used;
+    /// @brief The compaction pass that filled this block.
+    unsigned long int generation;
+    /// @brief Size of each slot, which depends on whether the tree that
+    /// filled the block has a change feed.
+    unsigned long int slot_size;
+    /// @brief Node storage.
+    rbtree_node_t nodes[];
+} arena_t;
+
+/**
+ * Nodes of a tree with a change feed are allocated with room for their
+ * versions after the node itself, so that other trees don't pay for them.
+ */
+typedef struct versioned_node_t {
+    rbtree_node_t node;
+    /// @brief Tree version of the node's last change.
+    uint64_t version;
+    /// @brief The highest version in the subtree rooted at this node.
+    uint64_t max_version;
+} versioned_node_t;
+
+/**
+ * A removal recorded by the change feed.
+ */
+typedef struct change_t {
+    /// @brief One of RBTREE_CHANGE_DELETE, _EXPIRE or _CLEAR.
+    int change;
+    /// @brief The removed key, the expiry cutoff, or NULL.
+    void *key;
+    /// @brief Tree version of the removal.
+    uint64_t version;
+} change_t;
+
+/**
+ * The removals recorded by the change feed, in a ring that overwrites the
+ * oldest entry when full.
+ */
+typedef struct change_feed_t {
+    rbtree_key_dup_func_t key_dup;
+    rbtree_key_free_func_t key_free;
+    unsigned long int capacity;
+    /// @brief Index of the oldest entry.
+    unsigned long int first;
+    unsigned long int count;
+    change_t changes[];
+} change_feed_t;
+
+#define RBTREE_ARENA_CAPACITY(a)    ((RBTREE_ARENA_SIZE - offsetof(arena_t, nodes)) / (a)->slot_size)
+#define RBTREE_ARENA_OF(n)          ((arena_t *)((uintptr_t)(n) & ~(uintptr_t)(RBTREE_ARENA_SIZE - 1)))
+#define RBTREE_VERSIONS(n)          ((versioned_node_t *)(n))
+
+static void adjust_sizes(rbtree_t *tree, rbtree_node_t *node, uint32_t size, uint32_t tombstones);
+static void attach(rbtree_t *tree, rbtree_node_t *node, rbtree_node_t *parent, int cmp);
+static rbtree_node_t *arena_alloc(rbtree_t *tree, void **slot, unsigned long int *allocated);
+static arena_t *arena_new(rbtree_t *tree);
+static unsigned long int arena_release(arena_t *arena);
+static int black_height(rbtree_t *tree, rbtree_node_t *node);
+static rbtree_node_t *build_balanced(rbtree_t *tree, rbtree_node_t **list, unsigned long int count, int depth, int red_depth);
+static void cache_clear(rbtree_t *tree);
+static void cache_forget(rbtree_t *tree, rbtree_node_t *node);
+static rbtree_node_t **cache_slot(rbtree_t *tree, void *key);
+static int changed_nodes(rbtree_t *tree, rbtree_node_t *node, uint64_t version, rbtree_change_func_t cb);
 static void delete_fixup(rbtree_t *tree, rbtree_node_t *x);
 static void delete_subtree(rbtree_t *tree, rbtree_node_t *node);
-static void insert_fixup(rbtree_t *tree, rbtree_node_t *node);
+static rbtree_node_t *descend(rbtree_t *tree, void *key, rbtree_node_t **parent, int *cmp);
+static void destroy_node(rbtree_t *tree, rbtree_node_t *node);
+static void find_ends(rbtree_t *tree);
+static void free_change_feed(change_feed_t *feed);
+static void free_node(rbtree_t *tree, rbtree_node_t *node);
+static unsigned long int free_memory(rbtree_node_t *node, size_t size);
+static int insert_fixup(rbtree_t *tree, rbtree_node_t *node);
+static double link_distance(rbtree_t *tree, rbtree_node_t *node, unsigned long int *links);
+static rbtree_node_t *lower_bound(rbtree_t *tree, void *key, int strict);
+static void move_node(rbtree_t *tree, rbtree_node_t *node, rbtree_node_t *copy, rbtree_relocate_func_t relocate, rbtree_compact_stats_t *stats);
+static rbtree_node_t *join(rbtree_t *tree, rbtree_node_t *left, int left_height, rbtree_node_t *node, rbtree_node_t *right, int right_height, int *height);
+static rbtree_node_t *next_node(rbtree_t *tree, rbtree_node_t *node);
+static rbtree_node_t *next_preorder(rbtree_t *tree, rbtree_node_t *node);
+static size_t node_size(rbtree_t *tree);
+static rbtree_node_t *prev_node(rbtree_t *tree, rbtree_node_t *node);
+static void rank_delete_fixup(rbtree_t *tree, rbtree_node_t *x, rbtree_node_t *p, int x_diff);
+static void rank_insert_fixup(rbtree_t *tree, rbtree_node_t *x);
+static void record_change(rbtree_t *tree, int change, void *key);
+static void remove_node(rbtree_t *tree, rbtree_node_t *node);
+static void replace_node(rbtree_t *tree, rbtree_node_t *old, rbtree_node_t *node);
+static void *reclaim_thread(void *arg);
 static void rotate_left(rbtree_t *tree, rbtree_node_t *x);
 static void rotate_right(rbtree_t *tree, rbtree_node_t *x);
+static rbtree_node_t *split_below(rbtree_t *tree, rbtree_node_t *node, int height, void *key, rbtree_detached_t *detached, int *result_height);
+static void stamp_node(rbtree_t *tree, rbtree_node_t *node);
+static int subtree_height(rbtree_t *tree, rbtree_node_t *node);
+static uint64_t subtree_max_version(rbtree_node_t *node);
 static void transplant(rbtree_t *tree, rbtree_node_t *u, rbtree_node_t *v);
+static void trim_ends(rbtree_t *tree);
+static void update_max_version(rbtree_node_t *node);
+static void update_size(rbtree_node_t *node);
+
+int rbtree_changes_since(rbtree_t *tree, uint64_t version, rbtree_change_func_t cb) {
+    change_feed_t *feed;
+    unsigned long int low = 0;
+    unsigned long int high;
+    int rc;
+    if (tree == NULL || tree->change_feed == NULL || cb == NULL || version < tree->resync_version) {
+        return -1;
+    }
+    // Removals are reported first, so a key that was removed and then
+    // inserted again ends up present.
+    feed = tree->change_feed;
+    high = feed->count;
+    while (low < high) {
+        unsigned long int mid = low + (high - low) / 2;
+        if (feed->changes[(feed->first + mid) % feed->capacity].version <= version) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (; low < feed->count; low++) {
+        change_t *change = &feed->changes[(feed->first + low) % feed->capacity];
+        rc = cb(change->change, change->key, NULL);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    return changed_nodes(tree, tree->root, version, cb);
+}
+
+int rbtree_compact(rbtree_t *tree, rbtree_relocate_func_t relocate, rbtree_compact_stats_t *stats) {
+    unsigned long int links = 0;
+    double before = 0.0;
+    double after;
+    int rc;
+    if (tree == NULL || tree->intrusive) {
+        return -1;
+    }
+    if (stats != NULL) {
+        before = link_distance(tree, tree->root, &links);
+        before = links != 0 ? before / links : 0.0;
+    }
+    rc = rbtree_compact_step(tree, ULONG_MAX, relocate, stats);
+    if (stats != NULL) {
+        links = 0;
+        after = link_distance(tree, tree->root, &links);
+        stats->link_distance_before = before;
+        stats->link_distance_after = links != 0 ? after / links : 0.0;
+    }
+    return rc;
+}
+
+int rbtree_compact_step(rbtree_t *tree, unsigned long int budget, rbtree_relocate_func_t relocate, rbtree_compact_stats_t *stats) {
+    rbtree_node_t *node;
+    if (tree == NULL || tree->intrusive) {
+        return -1;
+    }
+    if (stats != NULL) {
+        stats->nodes_moved = 0;
+        stats->bytes_allocated = 0;
+        stats->bytes_released = 0;
+        stats->link_distance_before = 0.0;
+        stats->link_distance_after = 0.0;
+    }
+    if (tree->compact_cursor == NULL) {
+        tree->compact_cursor = tree->root;
+        tree->compact_generation++;
+    }
+    // Nodes are copied in preorder, so each node is followed in memory by
+    // its left subtree. Nodes already copied during this pass are skipped.
+    node = tree->compact_cursor;
+    while (node != &tree->nil_node && budget > 0) {
+        if ((node->flags & RBTREE_ARENA_MASK) == 0 || RBTREE_ARENA_OF(node)->generation != tree->compact_generation) {
+            rbtree_node_t *copy = arena_alloc(tree, &tree->compact_arena, stats != NULL ? &stats->bytes_allocated : NULL);
+            if (copy == NULL) {
+                tree->compact_cursor = node;
+                return -1;
+            }
+            memcpy(copy, node, node_size(tree));
+            copy->flags |= RBTREE_ARENA_MASK;
+            move_node(tree, node, copy, relocate, stats);
+            node = copy;
+        }
+        node = next_preorder(tree, node);
+        budget--;
+    }
+    if (node != &tree->nil_node) {
+        tree->compact_cursor = node;
+        return 1;
+    }
+    tree->compact_cursor = NULL;
+    if (tree->compact_arena != NULL) {
+        unsigned long int released = arena_release(tree->compact_arena);
+        if (stats != NULL) {
+            stats->bytes_released += released;
+        }
+        tree->compact_arena = NULL;
+    }
+    return 0;
+}
 
 void rbtree_delete(rbtree_t *tree, rbtree_node_t *subtree) {
     if (tree == NULL || tree->root == &tree->nil_node) {
@@ -26,143 +259,374 @@ void rbtree_delete(rbtree_t *tree, rbtree_node_t *subtree) {
     if (subtree == NULL || subtree == &tree->nil_node) {
         subtree = tree->root;
     }
+    if (tree->journal != NULL || tree->change_feed != NULL) {
+        if (subtree == tree->root) {
+            if (tree->journal != NULL) {
+                rbtree_journal_log(tree->journal, RBTREE_JOURNAL_CLEAR, NULL, NULL);
+            }
+            if (tree->change_feed != NULL) {
+                record_change(tree, RBTREE_CHANGE_CLEAR, NULL);
+            }
+        } else {
+            rbtree_node_t *end = next_node(tree, rbtree_maximum(tree, subtree));
+            rbtree_node_t *node;
+            for (node = rbtree_minimum(tree, subtree); node != end; node = next_node(tree, node)) {
+                if (!RBTREE_IS_TOMBSTONE(node)) {
+                    if (tree->journal != NULL) {
+                        rbtree_journal_log(tree->journal, RBTREE_JOURNAL_DELETE, node->key, NULL);
+                    }
+                    if (tree->change_feed != NULL) {
+                        record_change(tree, RBTREE_CHANGE_DELETE, node->key);
+                    }
+                }
+            }
+        }
+    }
     delete_subtree(tree, subtree);
+    if (subtree == tree->root) {
+        tree->root = &tree->nil_node;
+    }
+    find_ends(tree);
+    trim_ends(tree);
+    if (tree->compact_cursor != NULL) {
+        tree->compact_cursor = tree->root;
+    }
 }
 
 void rbtree_delete_node(rbtree_t *tree, rbtree_node_t *node) {
-    rbtree_node_t *w = node;
-    rbtree_node_t *x;
-    rbtree_node_t *y = node;
-    uint32_t color = y->flags & RBTREE_COLOR_MASK;
-    if (node->left == &tree->nil_node) {
-        x = node->right;
-        transplant(tree, node, node->right);
-    } else if (node->right == &tree->nil_node) {
-        x = node->left;
-        transplant(tree, node, node->left);
+    if (RBTREE_IS_TOMBSTONE(node)) {
+        return;
+    }
+    if (tree->journal != NULL) {
+        rbtree_journal_log(tree->journal, RBTREE_JOURNAL_DELETE, node->key, NULL);
+    }
+    if (tree->change_feed != NULL) {
+        record_change(tree, RBTREE_CHANGE_DELETE, node->key);
+    }
+    if (tree->purge_ratio != 0) {
+        cache_forget(tree, node);
+        node->flags |= RBTREE_TOMBSTONE_MASK;
+        adjust_sizes(tree, node, 0, 1);
+        tree->node_count--;
+        tree->tombstone_count++;
+        trim_ends(tree);
+        if (tree->tombstone_count * 100 >= (tree->node_count + tree->tombstone_count) * tree->purge_ratio) {
+            rbtree_purge(tree);
+        }
+        return;
+    }
+    remove_node(tree, node);
+    destroy_node(tree, node);
+    trim_ends(tree);
+}
+
+rbtree_detached_t *rbtree_detach_all(rbtree_t *tree) {
+    rbtree_detached_t *detached;
+    if (tree == NULL || tree->root == &tree->nil_node) {
+        return NULL;
+    }
+    detached = malloc(sizeof(rbtree_detached_t));
+    if (detached == NULL) {
+        return NULL;
+    }
+    if (tree->journal != NULL) {
+        rbtree_journal_log(tree->journal, RBTREE_JOURNAL_CLEAR, NULL, NULL);
+    }
+    if (tree->change_feed != NULL) {
+        record_change(tree, RBTREE_CHANGE_CLEAR, NULL);
+    }
+    detached->root = tree->root;
+    detached->nil = &tree->nil_node;
+    detached->del_func = tree->del_func;
+    detached->expire_func = NULL;
+    detached->node_count = tree->node_count + tree->tombstone_count;
+    detached->intrusive = tree->intrusive;
+    tree->root = &tree->nil_node;
+    tree->leftmost = &tree->nil_node;
+    tree->rightmost = &tree->nil_node;
+    tree->node_count = 0;
+    tree->tombstone_count = 0;
+    cache_clear(tree);
+    if (tree->compact_cursor != NULL) {
+        tree->compact_cursor = tree->root;
+    }
+    return detached;
+}
+
+unsigned long int rbtree_export(rbtree_t *tree, rbtree_export_token_t *token, void **keys_out, void **data_out, unsigned long int max) {
+    rbtree_node_t *node;
+    unsigned long int n = 0;
+    if (tree == NULL || token == NULL || token->state == RBTREE_EXPORT_END || max == 0) {
+        return 0;
+    }
+    if (token->state == RBTREE_EXPORT_BEGIN) {
+        node = tree->leftmost;
     } else {
-        y = rbtree_minimum(tree, node->right);
-        color = y->flags & RBTREE_COLOR_MASK;
-        x = y->right;
-        if (y->parent == node) {
-            x->parent = y;
-        } else {
-            transplant(tree, y, y->right);
-            y->right = node->right;
-            y->right->parent = y;
+        node = lower_bound(tree, token->key, token->state == RBTREE_EXPORT_AFTER);
+    }
+    while (node != &tree->nil_node && n < max) {
+        if (!RBTREE_IS_TOMBSTONE(node)) {
+            if (keys_out != NULL) {
+                keys_out[n] = node->key;
+            }
+            if (data_out != NULL) {
+                data_out[n] = node->data;
+            }
+            token->key = node->key;
+            n++;
         }
-        transplant(tree, node, y);
-        y->left = node->left;
-        y->left->parent = y;
-        y->flags &= RBTREE_USER_MASK;
-        y->flags |= node->flags & RBTREE_COLOR_MASK;
+        node = next_node(tree, node);
     }
-    if (tree->del_func != NULL) {
-        tree->del_func(w);
+    token->state = node != &tree->nil_node ? RBTREE_EXPORT_AFTER : RBTREE_EXPORT_END;
+    return n;
+}
+
+rbtree_detached_t *rbtree_expire_before(rbtree_t *tree, void *key, rbtree_node_delete_func_t cb) {
+    rbtree_detached_t *detached;
+    rbtree_node_t *root;
+    int height;
+    if (tree == NULL || tree->leftmost == &tree->nil_node || tree->cmp_func(tree->leftmost->key, key) >= 0) {
+        return NULL;
     }
-    free(w);
-    if (color == 0) {
-        delete_fixup(tree, x);
+    detached = malloc(sizeof(rbtree_detached_t));
+    if (detached == NULL) {
+        return NULL;
+    }
+    detached->root = &tree->nil_node;
+    detached->nil = &tree->nil_node;
+    detached->del_func = tree->del_func;
+    detached->expire_func = cb;
+    detached->node_count = 0;
+    detached->intrusive = tree->intrusive;
+    if (tree->journal != NULL) {
+        rbtree_journal_log(tree->journal, RBTREE_JOURNAL_EXPIRE, key, NULL);
+    }
+    if (tree->change_feed != NULL) {
+        record_change(tree, RBTREE_CHANGE_EXPIRE, key);
+    }
+    cache_clear(tree);
+    if (tree->policy != RBTREE_POLICY_RB) {
+        // The split relies on red-black joins, so the other policies remove
+        // expired nodes one at a time, chaining them through their right
+        // pointers.
+        while (tree->leftmost != &tree->nil_node && tree->cmp_func(tree->leftmost->key, key) < 0) {
+            rbtree_node_t *node = tree->leftmost;
+            remove_node(tree, node);
+            node->left = &tree->nil_node;
+            node->right = detached->root;
+            detached->root = node;
+            detached->node_count++;
+        }
+        trim_ends(tree);
+        return detached;
+    }
+    root = split_below(tree, tree->root, black_height(tree, tree->root), key, detached, &height);
+    root->parent = &tree->nil_node;
+    tree->root = root;
+    RBTREE_SET_BLACK(tree->root);
+    tree->nil_node.left = tree->nil_node.right = tree->nil_node.parent = &tree->nil_node;
+    find_ends(tree);
+    trim_ends(tree);
+    if (tree->compact_cursor != NULL) {
+        tree->compact_cursor = tree->root;
+    }
+    return detached;
+}
+
+rbtree_node_t *rbtree_first(rbtree_t *tree) {
+    if (tree == NULL) {
+        return NULL;
+    }
+    rbtree_node_t *node = rbtree_minimum(tree, NULL);
+    if (node == &tree->nil_node) {
+        return NULL;
     }
-    tree->node_count--;
+    return node;
 }
 
 void rbtree_free(rbtree_t *tree) {
     if (tree != NULL) {
+        if (tree->journal != NULL) {
+            rbtree_journal_close(tree);
+        }
+        free_change_feed(tree->change_feed);
+        tree->change_feed = NULL;
         if (tree->root != &tree->nil_node) {
             rbtree_delete(tree, NULL);
         }
+        if (tree->compact_arena != NULL) {
+            arena_release(tree->compact_arena);
+        }
+        if (tree->insert_arena != NULL) {
+            arena_release(tree->insert_arena);
+        }
+        free(tree->lookup_cache);
     }
     free(tree);
 }
 
 char **rbtree_get_keys(rbtree_t *tree) {
-    char **keys = NULL;
-    rbtree_node_t **stack = NULL;
-    int i = 0;
-    int j = 0;
-    if (tree != NULL) {
-        stack = malloc(tree->node_count * sizeof(rbtree_node_t *));
-        keys = malloc(tree->node_count * (sizeof(char *) + 1));
-        if (keys != NULL && stack != NULL) {
-            rbtree_node_t *n = tree->root;
-            while (n != &tree->nil_node || i > 0) {
-                if (n != &tree->nil_node) {
-                    stack[i++] = n;
-                    n = n->left;
-                } else {
-                    n = stack[--i];
-                    keys[j++] = n->key;
-                    n = n->right;
-                }
-            }
-            free(stack);
-        }
-        keys[j] = NULL;
+    rbtree_export_token_t token = { NULL, RBTREE_EXPORT_BEGIN };
+    char **keys;
+    unsigned long int n;
+    if (tree == NULL) {
+        return NULL;
+    }
+    keys = malloc((tree->node_count + 1) * sizeof(char *));
+    if (keys == NULL) {
+        return NULL;
     }
+    n = rbtree_export(tree, &token, (void **)keys, NULL, tree->node_count);
+    keys[n] = NULL;
     return keys;
 }
 
+int rbtree_height(rbtree_t *tree) {
+    if (tree == NULL) {
+        return 0;
+    }
+    return subtree_height(tree, tree->root);
+}
+
 rbtree_node_t *rbtree_insert(rbtree_t *tree, void *key) {
-    rbtree_node_t *child = tree->root;
-    rbtree_node_t *parent = &tree->nil_node;
-    rbtree_node_t *node = NULL;
-    uint32_t color = RBTREE_COLOR_RED;
-    int i = 0;
-    while (child != &tree->nil_node) {
-        parent = child;
-        i = tree->cmp_func(key, child->key);
-        if (i < 0) {
-            child = child->left;
-        } else if (i == 0) {
-            return child;
-        } else {
-            child = child->right;
+    rbtree_node_t *parent;
+    rbtree_node_t *node;
+    int i;
+    node = descend(tree, key, &parent, &i);
+    if (node != &tree->nil_node) {
+        if (RBTREE_IS_TOMBSTONE(node)) {
+            if (tree->del_func != NULL) {
+                tree->del_func(node);
+            }
+            node->flags &= ~RBTREE_TOMBSTONE_MASK;
+            adjust_sizes(tree, node, 0, (uint32_t)-1);
+            node->key = key;
+            node->data = NULL;
+            tree->tombstone_count--;
+            tree->node_count++;
+            if (tree->journal != NULL) {
+                rbtree_journal_log(tree->journal, RBTREE_JOURNAL_PUT, key, NULL);
+            }
+            if (tree->change_feed != NULL) {
+                stamp_node(tree, node);
+            }
         }
+        return node;
     }
-    node = malloc(sizeof(rbtree_node_t));
-    if (node == NULL) {
+    if (tree->intrusive || tree->node_count + tree->tombstone_count >= UINT32_MAX) {
         return NULL;
     }
-    if (parent == &tree->nil_node) {
-        tree->root = node;
-        color = RBTREE_COLOR_BLACK;
-    } else if (i < 0) {
-        parent->left = node;
+    if (tree->numa_node >= 0) {
+        node = arena_alloc(tree, &tree->insert_arena, NULL);
     } else {
-        parent->right = node;
+        node = malloc(node_size(tree));
     }
-    node->parent = parent;
-    node->left = &tree->nil_node;
-    node->right = &tree->nil_node;
-    node->flags = color;
+    if (node == NULL) {
+        return NULL;
+    }
+    node->flags = tree->numa_node >= 0 ? RBTREE_ARENA_MASK : 0;
     node->key = key;
-    insert_fixup(tree, node);
-    tree->node_count++;
+    node->data = NULL;
+    if (tree->change_feed != NULL) {
+        RBTREE_VERSIONS(node)->version = 0;
+        RBTREE_VERSIONS(node)->max_version = 0;
+    }
+    attach(tree, node, parent, i);
+    if (tree->journal != NULL) {
+        rbtree_journal_log(tree->journal, RBTREE_JOURNAL_PUT, key, NULL);
+    }
+    if (tree->change_feed != NULL) {
+        stamp_node(tree, node);
+    }
+    return node;
+}
+
+int rbtree_key_compare_uint64(void *a, void *b) {
+    if ((uint64_t)a < (uint64_t)b) {
+        return -1;
+    } else if ((uint64_t)a == (uint64_t)b) {
+        return 0;
+    }
+    return 1;
+}
+
+rbtree_node_t *rbtree_last(rbtree_t *tree) {
+    if (tree == NULL) {
+        return NULL;
+    }
+    rbtree_node_t *node = rbtree_maximum(tree, NULL);
+    if (node == &tree->nil_node) {
+        return NULL;
+    }
+    return node;
+}
+
+rbtree_node_t *rbtree_link(rbtree_t *tree, rbtree_node_t *node) {
+    rbtree_node_t *parent;
+    rbtree_node_t *match;
+    int i;
+    if (tree == NULL || !tree->intrusive) {
+        return NULL;
+    }
+    match = descend(tree, node->key, &parent, &i);
+    if (match != &tree->nil_node) {
+        if (!RBTREE_IS_TOMBSTONE(match)) {
+            return match;
+        }
+        replace_node(tree, match, node);
+        adjust_sizes(tree, node, 0, (uint32_t)-1);
+        tree->tombstone_count--;
+        tree->node_count++;
+        destroy_node(tree, match);
+    } else {
+        if (tree->node_count + tree->tombstone_count >= UINT32_MAX) {
+            return NULL;
+        }
+        node->flags &= RBTREE_USER_MASK;
+        attach(tree, node, parent, i);
+    }
     return node;
 }
 
 rbtree_node_t *rbtree_lookup(rbtree_t *tree, void *key) {
+    rbtree_node_t **slot = NULL;
+    rbtree_node_t *parent;
+    rbtree_node_t *node;
+    int i;
     if (tree == NULL) {
         return NULL;
     }
-    rbtree_node_t *node = tree->root;
-    while (node != &tree->nil_node) {
-        int i = tree->cmp_func(key, node->key);
-        if (i == 0) {
-            return node;
-        } else if (i < 0) {
-            node = node->left;
-        } else {
-            node = node->right;
+    if (tree->lookup_cache != NULL) {
+        slot = cache_slot(tree, key);
+        for (i = 0; i < RBTREE_CACHE_WAYS; i++) {
+            node = slot[i];
+            if (node != NULL && (tree->cmp_func == rbtree_key_compare_uint64 ? node->key == key : tree->cmp_func(key, node->key) == 0)) {
+                // Keep the most recently used node first.
+                slot[i] = slot[0];
+                slot[0] = node;
+                tree->cache_hits++;
+                return node;
+            }
         }
+        tree->cache_misses++;
     }
-    return NULL;
+    node = descend(tree, key, &parent, &i);
+    if (node == &tree->nil_node || RBTREE_IS_TOMBSTONE(node)) {
+        return NULL;
+    }
+    if (slot != NULL) {
+        for (i = RBTREE_CACHE_WAYS - 1; i > 0; i--) {
+            slot[i] = slot[i - 1];
+        }
+        slot[0] = node;
+    }
+    return node;
 }
 
 rbtree_node_t *rbtree_maximum(rbtree_t *tree, rbtree_node_t *subtree) {
     if (subtree == NULL) {
-        subtree = tree->root;
+        // trim_ends() keeps tombstones away from the ends of the tree.
+        return tree->rightmost;
     }
     while (subtree != &tree->nil_node && subtree->right != &tree->nil_node) {
         subtree = subtree->right;
@@ -172,7 +636,8 @@ rbtree_node_t *rbtree_maximum(rbtree_t *tree, rbtree_node_t *subtree) {
 
 rbtree_node_t *rbtree_minimum(rbtree_t *tree, rbtree_node_t *subtree) {
     if (subtree == NULL) {
-        subtree = tree->root;
+        // trim_ends() keeps tombstones away from the ends of the tree.
+        return tree->leftmost;
     }
     while (subtree != &tree->nil_node && subtree->left != &tree->nil_node) {
         subtree = subtree->left;
@@ -184,6 +649,8 @@ rbtree_t *rbtree_new(rbtree_key_compare_func_t cmp_func, rbtree_node_delete_func
     rbtree_t *rbtree = calloc(1, sizeof(rbtree_t));
     if (rbtree != NULL) {
         rbtree->root = &rbtree->nil_node;
+        rbtree->leftmost = &rbtree->nil_node;
+        rbtree->rightmost = &rbtree->nil_node;
         rbtree->cmp_func = cmp_func;
         rbtree->del_func = del_func;
         rbtree->nil_node.parent = 
@@ -191,68 +658,596 @@ rbtree_t *rbtree_new(rbtree_key_compare_func_t cmp_func, rbtree_node_delete_func
             rbtree->nil_node.right = 
             &rbtree->nil_node;
         rbtree->nil_node.flags = RBTREE_COLOR_BLACK;
+        rbtree->numa_node = -1;
     }
     return rbtree;
 }
 
-int rbtree_traverse_ascending(rbtree_t *tree, rbtree_node_t *subtree, rbtree_traverse_func_t cb) {
-    int i;
-    if (tree == NULL || tree->root == &tree->nil_node) {
+rbtree_t *rbtree_new_intrusive(rbtree_key_compare_func_t cmp_func, rbtree_node_delete_func_t del_func) {
+    rbtree_t *rbtree = rbtree_new(cmp_func, del_func);
+    if (rbtree != NULL) {
+        rbtree->intrusive = 1;
+    }
+    return rbtree;
+}
+
+rbtree_t *rbtree_new_with_policy(rbtree_key_compare_func_t cmp_func, rbtree_node_delete_func_t del_func, int policy) {
+    rbtree_t *rbtree;
+    if (policy != RBTREE_POLICY_RB && policy != RBTREE_POLICY_WAVL && policy != RBTREE_POLICY_AVL) {
+        return NULL;
+    }
+    rbtree = rbtree_new(cmp_func, del_func);
+    if (rbtree != NULL && policy != RBTREE_POLICY_RB) {
+        rbtree->policy = policy;
+        rbtree->nil_node.flags = RBTREE_COLOR_MASK;
+    }
+    return rbtree;
+}
+
+int rbtree_pop_max(rbtree_t *tree, void **key, void **data) {
+    rbtree_node_t *node;
+    if (tree == NULL) {
         return -1;
     }
-    if (subtree == NULL || subtree == &tree->nil_node) {
-        subtree = tree->root;
+    if (tree->rightmost == &tree->nil_node) {
+        return -1;
     }
-    if (subtree->left != &tree->nil_node) {
-        i = rbtree_traverse_ascending(tree, subtree->left, cb);
-        if (i != 0) {
-            return i;
-        }
+    node = tree->rightmost;
+    if (tree->journal != NULL) {
+        rbtree_journal_log(tree->journal, RBTREE_JOURNAL_DELETE, node->key, NULL);
     }
-    if (cb != NULL) {
-        i = cb(subtree);
-        if (i != 0) {
-            return i;
-        }
+    if (tree->change_feed != NULL) {
+        record_change(tree, RBTREE_CHANGE_DELETE, node->key);
     }
-    if (subtree->right != &tree->nil_node) {
-        i = rbtree_traverse_ascending(tree, subtree->right, cb);
-        if (i != 0) {
-            return i;
-        }
+    remove_node(tree, node);
+    if (key != NULL) {
+        *key = node->key;
     }
+    if (data != NULL) {
+        *data = node->data;
+    }
+    free_node(tree, node);
+    trim_ends(tree);
     return 0;
 }
 
-int rbtree_traverse_descending(rbtree_t *tree, rbtree_node_t *subtree, rbtree_traverse_func_t cb) {
-    int i;
-    if (tree == NULL || tree->root == &tree->nil_node) {
+int rbtree_pop_min(rbtree_t *tree, void **key, void **data) {
+    rbtree_node_t *node;
+    if (tree == NULL) {
         return -1;
     }
-    if (subtree == NULL || subtree == &tree->nil_node) {
-        subtree = tree->root;
+    if (tree->leftmost == &tree->nil_node) {
+        return -1;
     }
-    if (subtree->right != &tree->nil_node) {
-        i = rbtree_traverse_descending(tree, subtree->right, cb);
-        if (i != 0) {
-            return i;
-        }
+    node = tree->leftmost;
+    if (tree->journal != NULL) {
+        rbtree_journal_log(tree->journal, RBTREE_JOURNAL_DELETE, node->key, NULL);
     }
-    if (cb != NULL) {
-        int i = cb(subtree);
-        if (i != 0) {
-            return i;
-        }
+    if (tree->change_feed != NULL) {
+        record_change(tree, RBTREE_CHANGE_DELETE, node->key);
     }
-    if (subtree->left != &tree->nil_node) {
-        i = rbtree_traverse_descending(tree, subtree->left, cb);
-        if (i != 0) {
-            return i;
-        }
+    remove_node(tree, node);
+    if (key != NULL) {
+        *key = node->key;
+    }
+    if (data != NULL) {
+        *data = node->data;
+    }
+    free_node(tree, node);
+    trim_ends(tree);
+    return 0;
+}
+
+void rbtree_purge(rbtree_t *tree) {
+    rbtree_node_t vine;
+    rbtree_node_t *tail = &vine;
+    rbtree_node_t *rest;
+    rbtree_node_t *list;
+    int red_depth = 0;
+    if (tree == NULL || tree->tombstone_count == 0) {
+        return;
+    }
+    // Flatten the tree into a list linked through the right pointers by
+    // rotating left children up, dropping tombstones as they reach the front.
+    rest = tree->root;
+    while (rest != &tree->nil_node) {
+        if (rest->left != &tree->nil_node) {
+            rbtree_node_t *left = rest->left;
+            rest->left = left->right;
+            left->right = rest;
+            rest = left;
+        } else if (RBTREE_IS_TOMBSTONE(rest)) {
+            rbtree_node_t *dead = rest;
+            rest = rest->right;
+            destroy_node(tree, dead);
+        } else {
+            tail->right = rest;
+            tail = rest;
+            rest = rest->right;
+        }
+    }
+    tail->right = &tree->nil_node;
+    tree->tombstone_count = 0;
+    // Nodes on the bottom level of an incomplete tree are colored red so
+    // that every path has the same number of black nodes.
+    while ((2UL << red_depth) - 1 <= tree->node_count) {
+        red_depth++;
+    }
+    list = vine.right;
+    tree->root = build_balanced(tree, &list, tree->node_count, 0, red_depth);
+    tree->root->parent = &tree->nil_node;
+    tree->nil_node.left = tree->nil_node.right = tree->nil_node.parent = &tree->nil_node;
+    find_ends(tree);
+    if (tree->compact_cursor != NULL) {
+        tree->compact_cursor = tree->root;
+    }
+}
+
+int rbtree_reclaim_background(rbtree_detached_t *detached) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    int rc;
+    if (detached == NULL) {
+        return 0;
+    }
+    if (pthread_attr_init(&attr) != 0) {
+        return -1;
+    }
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rc = pthread_create(&thread, &attr, reclaim_thread, detached);
+    pthread_attr_destroy(&attr);
+    return rc == 0 ? 0 : -1;
+}
+
+unsigned long int rbtree_reclaim_step(rbtree_detached_t *detached, unsigned long int budget) {
+    rbtree_node_t *node;
+    if (detached == NULL) {
+        return 0;
+    }
+    // Rotating left children up turns the detached nodes into a list that
+    // can be consumed from the front without a stack.
+    node = detached->root;
+    while (node != detached->nil && budget > 0) {
+        if (node->left != detached->nil) {
+            rbtree_node_t *left = node->left;
+            node->left = left->right;
+            left->right = node;
+            node = left;
+        } else {
+            rbtree_node_t *dead = node;
+            node = node->right;
+            if (RBTREE_IS_TOMBSTONE(dead) || detached->expire_func == NULL) {
+                if (detached->del_func != NULL) {
+                    detached->del_func(dead);
+                }
+            } else {
+                detached->expire_func(dead);
+            }
+            if (!detached->intrusive) {
+                free_memory(dead, 0);
+            }
+            detached->node_count--;
+            budget--;
+        }
+    }
+    detached->root = node;
+    if (node == detached->nil) {
+        free(detached);
+        return 0;
+    }
+    return detached->node_count;
+}
+
+int rbtree_set_change_feed(rbtree_t *tree, unsigned long int capacity, rbtree_key_dup_func_t key_dup, rbtree_key_free_func_t key_free) {
+    change_feed_t *feed = NULL;
+    if (tree == NULL) {
+        return -1;
+    }
+    // Nodes allocated without a feed have no room for versions.
+    if (capacity != 0 && tree->change_feed == NULL && (tree->intrusive || tree->node_count + tree->tombstone_count != 0)) {
+        return -1;
+    }
+    if (capacity != 0) {
+        feed = malloc(sizeof(change_feed_t) + capacity * sizeof(change_t));
+        if (feed == NULL) {
+            return -1;
+        }
+        feed->key_dup = key_dup;
+        feed->key_free = key_free;
+        feed->capacity = capacity;
+        feed->first = 0;
+        feed->count = 0;
+    }
+    free_change_feed(tree->change_feed);
+    tree->change_feed = feed;
+    // Nothing that happened before now was recorded.
+    tree->resync_version = tree->version;
+    return 0;
+}
+
+void rbtree_set_data(rbtree_t *tree, rbtree_node_t *node, void *data) {
+    node->data = data;
+    if (tree->journal != NULL) {
+        rbtree_journal_log(tree->journal, RBTREE_JOURNAL_PUT, node->key, data);
+    }
+    if (tree->change_feed != NULL) {
+        stamp_node(tree, node);
+    }
+}
+
+void rbtree_set_lazy_delete(rbtree_t *tree, unsigned int purge_ratio) {
+    if (tree == NULL) {
+        return;
+    }
+    if (purge_ratio > 100) {
+        purge_ratio = 100;
+    }
+    tree->purge_ratio = purge_ratio;
+    if (purge_ratio == 0) {
+        rbtree_purge(tree);
+    }
+}
+
+int rbtree_set_lookup_cache(rbtree_t *tree, unsigned long int slots, rbtree_key_hash_func_t hash) {
+    rbtree_node_t **cache = NULL;
+    unsigned long int size = 0;
+    if (tree == NULL) {
+        return -1;
+    }
+    // Hashing the key pointer only works when equal keys are equal pointers,
+    // otherwise a node can be cached in a set that cache_forget() never
+    // looks at and outlive its deletion there.
+    if (slots != 0 && hash == NULL && tree->cmp_func != rbtree_key_compare_uint64) {
+        return -1;
+    }
+    if (slots != 0) {
+        size = RBTREE_CACHE_WAYS;
+        while (size < slots) {
+            size <<= 1;
+        }
+        cache = calloc(size, sizeof(rbtree_node_t *));
+        if (cache == NULL) {
+            return -1;
+        }
+    }
+    free(tree->lookup_cache);
+    tree->lookup_cache = cache;
+    tree->cache_mask = size / RBTREE_CACHE_WAYS - 1;
+    tree->cache_hash = hash;
+    tree->cache_hits = 0;
+    tree->cache_misses = 0;
+    return 0;
+}
+
+int rbtree_set_numa_node(rbtree_t *tree, int numa_node) {
+    if (tree == NULL || tree->intrusive) {
+        return -1;
+    }
+    if (tree->insert_arena != NULL) {
+        arena_release(tree->insert_arena);
+        tree->insert_arena = NULL;
+    }
+    tree->numa_node = numa_node;
+    // Map the first block now, so that a node that can't be bound is
+    // reported here rather than by the next insert.
+    if (numa_node >= 0) {
+        tree->insert_arena = arena_new(tree);
+        if (tree->insert_arena == NULL) {
+            tree->numa_node = -1;
+            return -1;
+        }
     }
     return 0;
 }
 
+int rbtree_traverse_ascending(rbtree_t *tree, rbtree_node_t *subtree, rbtree_traverse_func_t cb) {
+    int i;
+    if (tree == NULL || tree->root == &tree->nil_node) {
+        return -1;
+    }
+    if (subtree == NULL || subtree == &tree->nil_node) {
+        subtree = tree->root;
+    }
+    if (subtree->left != &tree->nil_node) {
+        i = rbtree_traverse_ascending(tree, subtree->left, cb);
+        if (i != 0) {
+            return i;
+        }
+    }
+    if (cb != NULL && !RBTREE_IS_TOMBSTONE(subtree)) {
+        i = cb(subtree);
+        if (i != 0) {
+            return i;
+        }
+    }
+    if (subtree->right != &tree->nil_node) {
+        i = rbtree_traverse_ascending(tree, subtree->right, cb);
+        if (i != 0) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+int rbtree_traverse_descending(rbtree_t *tree, rbtree_node_t *subtree, rbtree_traverse_func_t cb) {
+    int i;
+    if (tree == NULL || tree->root == &tree->nil_node) {
+        return -1;
+    }
+    if (subtree == NULL || subtree == &tree->nil_node) {
+        subtree = tree->root;
+    }
+    if (subtree->right != &tree->nil_node) {
+        i = rbtree_traverse_descending(tree, subtree->right, cb);
+        if (i != 0) {
+            return i;
+        }
+    }
+    if (cb != NULL && !RBTREE_IS_TOMBSTONE(subtree)) {
+        int i = cb(subtree);
+        if (i != 0) {
+            return i;
+        }
+    }
+    if (subtree->left != &tree->nil_node) {
+        i = rbtree_traverse_descending(tree, subtree->left, cb);
+        if (i != 0) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+void rbtree_unlink(rbtree_t *tree, rbtree_node_t *node) {
+    if (tree->journal != NULL && !RBTREE_IS_TOMBSTONE(node)) {
+        rbtree_journal_log(tree->journal, RBTREE_JOURNAL_DELETE, node->key, NULL);
+    }
+    if (tree->change_feed != NULL && !RBTREE_IS_TOMBSTONE(node)) {
+        record_change(tree, RBTREE_CHANGE_DELETE, node->key);
+    }
+    remove_node(tree, node);
+    node->flags &= ~RBTREE_TOMBSTONE_MASK;
+    node->parent = node->left = node->right = NULL;
+    trim_ends(tree);
+}
+
+/**
+ * Add size and tombstones to the counts of node and its ancestors. The
+ * arithmetic wraps, so negated counts subtract.
+ */
+static void adjust_sizes(rbtree_t *tree, rbtree_node_t *node, uint32_t size, uint32_t tombstones) {
+    while (node != &tree->nil_node) {
+        node->size += size;
+        node->tombstones += tombstones;
+        node = node->parent;
+    }
+}
+
+static void attach(rbtree_t *tree, rbtree_node_t *node, rbtree_node_t *parent, int cmp) {
+    if (parent == &tree->nil_node) {
+        tree->root = node;
+        tree->leftmost = node;
+        tree->rightmost = node;
+    } else if (cmp < 0) {
+        parent->left = node;
+        if (parent == tree->leftmost) {
+            tree->leftmost = node;
+        }
+    } else {
+        parent->right = node;
+        if (parent == tree->rightmost) {
+            tree->rightmost = node;
+        }
+    }
+    node->parent = parent;
+    node->left = &tree->nil_node;
+    node->right = &tree->nil_node;
+    node->size = 1;
+    node->tombstones = 0;
+    adjust_sizes(tree, parent, 1, 0);
+    if (tree->policy != RBTREE_POLICY_RB) {
+        // A new leaf has rank 0.
+        node->flags &= ~RBTREE_COLOR_MASK;
+        rank_insert_fixup(tree, node);
+    } else {
+        if (parent == &tree->nil_node) {
+            RBTREE_SET_BLACK(node);
+        } else {
+            RBTREE_SET_RED(node);
+        }
+        insert_fixup(tree, node);
+    }
+    tree->node_count++;
+}
+
+/**
+ * Hand out a slot from the arena block in *slot, starting a new block when
+ * it is full.
+ */
+static rbtree_node_t *arena_alloc(rbtree_t *tree, void **slot, unsigned long int *allocated) {
+    arena_t *arena = *slot;
+    if (arena == NULL || arena->used == RBTREE_ARENA_CAPACITY(arena) || arena->slot_size != node_size(tree)) {
+        arena = arena_new(tree);
+        if (arena == NULL) {
+            return NULL;
+        }
+        if (*slot != NULL) {
+            arena_release(*slot);
+        }
+        *slot = arena;
+        if (allocated != NULL) {
+            *allocated += RBTREE_ARENA_SIZE;
+        }
+    }
+    __atomic_add_fetch(&arena->live, 1, __ATOMIC_RELAXED);
+    return (rbtree_node_t *)((unsigned char *)arena->nodes + arena->used++ * arena->slot_size);
+}
+
+/**
+ * Map a new arena block. mmap() only aligns to the page size, so twice the
+ * block size is mapped and the unaligned ends are unmapped again. Blocks of
+ * a tree with a NUMA node are bound to that node, and NULL is returned if
+ * that fails, e.g. because the node doesn't exist.
+ */
+static arena_t *arena_new(rbtree_t *tree) {
+    arena_t *arena;
+    uintptr_t start;
+    uintptr_t aligned;
+    void *p = mmap(NULL, RBTREE_ARENA_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    start = (uintptr_t)p;
+    aligned = (start + RBTREE_ARENA_SIZE - 1) & ~(uintptr_t)(RBTREE_ARENA_SIZE - 1);
+    if (aligned != start) {
+        munmap(p, aligned - start);
+    }
+    munmap((void *)(aligned + RBTREE_ARENA_SIZE), start + RBTREE_ARENA_SIZE - aligned);
+    arena = (arena_t *)aligned;
+    if (tree->numa_node >= 0) {
+        int bound = 0;
+#ifdef SYS_mbind
+        if (tree->numa_node < (int)(sizeof(unsigned long int) * CHAR_BIT)) {
+            unsigned long int mask = 1UL << tree->numa_node;
+            bound = syscall(SYS_mbind, arena, RBTREE_ARENA_SIZE, RBTREE_MPOL_PREFERRED, &mask, sizeof(mask) * CHAR_BIT, RBTREE_MPOL_MF_MOVE) == 0;
+        }
+#endif
+        if (!bound) {
+            munmap(arena, RBTREE_ARENA_SIZE);
+            return NULL;
+        }
+    }
+    arena->live = 1;
+    arena->used = 0;
+    arena->generation = tree->compact_generation;
+    arena->slot_size = node_size(tree);
+    return arena;
+}
+
+static unsigned long int arena_release(arena_t *arena) {
+    if (__atomic_sub_fetch(&arena->live, 1, __ATOMIC_ACQ_REL) != 0) {
+        return 0;
+    }
+    munmap(arena, RBTREE_ARENA_SIZE);
+    return RBTREE_ARENA_SIZE;
+}
+
+static int black_height(rbtree_t *tree, rbtree_node_t *node) {
+    int height = 0;
+    while (node != &tree->nil_node) {
+        if (RBTREE_COLOR_IS_BLACK(node)) {
+            height++;
+        }
+        node = node->left;
+    }
+    return height;
+}
+
+static rbtree_node_t *build_balanced(rbtree_t *tree, rbtree_node_t **list, unsigned long int count, int depth, int red_depth) {
+    rbtree_node_t *left;
+    rbtree_node_t *node;
+    if (count == 0) {
+        return &tree->nil_node;
+    }
+    left = build_balanced(tree, list, (count - 1) / 2, depth + 1, red_depth);
+    node = *list;
+    *list = node->right;
+    node->left = left;
+    if (left != &tree->nil_node) {
+        left->parent = node;
+    }
+    node->right = build_balanced(tree, list, count / 2, depth + 1, red_depth);
+    if (node->right != &tree->nil_node) {
+        node->right->parent = node;
+    }
+    if (tree->policy != RBTREE_POLICY_RB) {
+        // The subtree is complete but for its bottom level, so its rank is
+        // its height, floor(log2(count)).
+        int rank = 0;
+        while ((count >> rank) > 1) {
+            rank++;
+        }
+        node->flags = (node->flags & ~RBTREE_COLOR_MASK) | ((rank & 1) ? RBTREE_COLOR_MASK : 0);
+    } else if (depth == red_depth) {
+        RBTREE_SET_RED(node);
+    } else {
+        RBTREE_SET_BLACK(node);
+    }
+    update_size(node);
+    if (tree->change_feed != NULL) {
+        update_max_version(node);
+    }
+    return node;
+}
+
+static void cache_clear(rbtree_t *tree) {
+    if (tree->lookup_cache != NULL) {
+        memset(tree->lookup_cache, 0, (tree->cache_mask + 1) * RBTREE_CACHE_WAYS * sizeof(rbtree_node_t *));
+    }
+}
+
+/**
+ * Drop a node from the lookup cache. Only the set its key hashes to can
+ * hold it. The nodes after it move up, keeping the set in recency order.
+ */
+static void cache_forget(rbtree_t *tree, rbtree_node_t *node) {
+    if (tree->lookup_cache != NULL) {
+        rbtree_node_t **slot = cache_slot(tree, node->key);
+        int i;
+        for (i = 0; i < RBTREE_CACHE_WAYS; i++) {
+            if (slot[i] == node) {
+                for (; i < RBTREE_CACHE_WAYS - 1; i++) {
+                    slot[i] = slot[i + 1];
+                }
+                slot[i] = NULL;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Find the set of RBTREE_CACHE_WAYS cache entries a key hashes to.
+ */
+static rbtree_node_t **cache_slot(rbtree_t *tree, void *key) {
+    uint64_t h;
+    if (tree->cache_hash != NULL) {
+        h = tree->cache_hash(key);
+    } else {
+        // Finalizer from MurmurHash3, so that keys differing only in their
+        // high bits don't share a slot.
+        h = (uint64_t)key;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+    }
+    return &tree->lookup_cache[(h & tree->cache_mask) * RBTREE_CACHE_WAYS];
+}
+
+/**
+ * Report the live nodes of a subtree changed after version, in key order.
+ * Subtrees with nothing newer are skipped.
+ */
+static int changed_nodes(rbtree_t *tree, rbtree_node_t *node, uint64_t version, rbtree_change_func_t cb) {
+    int rc;
+    if (node == &tree->nil_node || RBTREE_VERSIONS(node)->max_version <= version) {
+        return 0;
+    }
+    rc = changed_nodes(tree, node->left, version, cb);
+    if (rc != 0) {
+        return rc;
+    }
+    if (!RBTREE_IS_TOMBSTONE(node) && RBTREE_VERSIONS(node)->version > version) {
+        rc = cb(RBTREE_CHANGE_UPSERT, node->key, node->data);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    return changed_nodes(tree, node->right, version, cb);
+}
+
 static void delete_fixup(rbtree_t *tree, rbtree_node_t *x) {
     rbtree_node_t *w;
     while (x != tree->root && RBTREE_COLOR_IS_BLACK(x)) {
@@ -274,7 +1269,7 @@ static void delete_fixup(rbtree_t *tree, rbtree_node_t *x) {
                     rotate_right(tree, w);
                     w = x->parent->right;
                 }
-                w->flags &= RBTREE_USER_MASK;
+                w->flags &= ~RBTREE_COLOR_MASK;
                 w->flags |= x->parent->flags & RBTREE_COLOR_MASK;
                 RBTREE_SET_BLACK(x->parent);
                 RBTREE_SET_BLACK(w->right);
@@ -299,7 +1294,7 @@ static void delete_fixup(rbtree_t *tree, rbtree_node_t *x) {
                     rotate_left(tree, w);
                     w = x->parent->left;
                 }
-                w->flags &= RBTREE_USER_MASK;
+                w->flags &= ~RBTREE_COLOR_MASK;
                 w->flags |= x->parent->flags & RBTREE_COLOR_MASK;
                 RBTREE_SET_BLACK(x->parent);
                 RBTREE_SET_BLACK(w->left);
@@ -311,28 +1306,145 @@ static void delete_fixup(rbtree_t *tree, rbtree_node_t *x) {
     RBTREE_SET_BLACK(x);
 }
 
+/**
+ * Destroy a subtree without recursion, so that deep or very large trees
+ * can't overflow the stack. Left children are rotated up, as in
+ * rbtree_reclaim_step(), turning the subtree into a list as it is consumed.
+ */
 static void delete_subtree(rbtree_t *tree, rbtree_node_t *node) {
-    if (node->left != &tree->nil_node) {
-        delete_subtree(tree, node->left);
-    }
-    if (node->right != &tree->nil_node) {
-        delete_subtree(tree, node->right);
-    }
-    if (tree->del_func != NULL) {
-        tree->del_func(node);
-    }
     if (node->parent != &tree->nil_node) {
+        adjust_sizes(tree, node->parent, 0 - node->size, 0 - node->tombstones);
         if (node->parent->left == node) {
             node->parent->left = &tree->nil_node;
         } else if (node->parent->right == node) {
             node->parent->right = &tree->nil_node;
         }
     }
+    while (node != &tree->nil_node) {
+        if (node->left != &tree->nil_node) {
+            rbtree_node_t *left = node->left;
+            node->left = left->right;
+            left->right = node;
+            node = left;
+        } else {
+            rbtree_node_t *dead = node;
+            node = node->right;
+            if (RBTREE_IS_TOMBSTONE(dead)) {
+                tree->tombstone_count--;
+            } else {
+                tree->node_count--;
+                cache_forget(tree, dead);
+            }
+            destroy_node(tree, dead);
+        }
+    }
+}
+
+/**
+ * Walk down from the root looking for key. Returns the matching node, or
+ * nil_node if there is none, in which case parent and cmp describe where the
+ * key would be attached. Trees using rbtree_key_compare_uint64 compare keys
+ * inline rather than through the cmp_func pointer.
+ */
+static rbtree_node_t *descend(rbtree_t *tree, void *key, rbtree_node_t **parent, int *cmp) {
+    rbtree_node_t *node = tree->root;
+    int i = 0;
+    *parent = &tree->nil_node;
+    if (tree->cmp_func == rbtree_key_compare_uint64) {
+        uint64_t k = (uint64_t)key;
+        while (node != &tree->nil_node) {
+            uint64_t nk = (uint64_t)node->key;
+            if (k == nk) {
+                i = 0;
+                break;
+            }
+            *parent = node;
+            if (k < nk) {
+                i = -1;
+                node = node->left;
+            } else {
+                i = 1;
+                node = node->right;
+            }
+        }
+    } else {
+        while (node != &tree->nil_node) {
+            i = tree->cmp_func(key, node->key);
+            if (i == 0) {
+                break;
+            }
+            *parent = node;
+            if (i < 0) {
+                node = node->left;
+            } else {
+                node = node->right;
+            }
+        }
+    }
+    *cmp = i;
+    return node;
+}
+
+static void destroy_node(rbtree_t *tree, rbtree_node_t *node) {
+    if (tree->del_func != NULL) {
+        tree->del_func(node);
+    }
+    free_node(tree, node);
+}
+
+static void find_ends(rbtree_t *tree) {
+    tree->leftmost = tree->root;
+    tree->rightmost = tree->root;
+    while (tree->leftmost->left != &tree->nil_node) {
+        tree->leftmost = tree->leftmost->left;
+    }
+    while (tree->rightmost->right != &tree->nil_node) {
+        tree->rightmost = tree->rightmost->right;
+    }
+}
+
+static void free_change_feed(change_feed_t *feed) {
+    unsigned long int i;
+    if (feed == NULL) {
+        return;
+    }
+    if (feed->key_free != NULL) {
+        for (i = 0; i < feed->count; i++) {
+            change_t *change = &feed->changes[(feed->first + i) % feed->capacity];
+            if (change->key != NULL) {
+                feed->key_free(change->key);
+            }
+        }
+    }
+    free(feed);
+}
+
+/**
+ * Free the memory of a node, returning the bytes given back: size for a
+ * node from malloc(), or the whole block if it was the last node of an
+ * arena block.
+ */
+static unsigned long int free_memory(rbtree_node_t *node, size_t size) {
+    if (node->flags & RBTREE_ARENA_MASK) {
+        return arena_release(RBTREE_ARENA_OF(node));
+    }
     free(node);
-    tree->node_count--;
+    return size;
+}
+
+static void free_node(rbtree_t *tree, rbtree_node_t *node) {
+    if (!tree->intrusive) {
+        free_memory(node, 0);
+    }
 }
 
-static void insert_fixup(rbtree_t *tree, rbtree_node_t *node) {
+/**
+ * Repair a red violation at node after it was linked in red. Returns 1 if
+ * the root had to be turned black, which raised the black height of the
+ * tree.
+ */
+static int insert_fixup(rbtree_t *tree, rbtree_node_t *node) {
+    int grew;
     while (RBTREE_COLOR_IS_RED(node->parent)) {
         rbtree_node_t *parent = node->parent;
         rbtree_node_t *grandparent = parent->parent;
@@ -368,13 +1480,503 @@ static void insert_fixup(rbtree_t *tree, rbtree_node_t *node) {
             }
         }
     }
+    grew = RBTREE_COLOR_IS_RED(tree->root);
     RBTREE_SET_BLACK(tree->root);
     tree->nil_node.left = tree->nil_node.right = tree->nil_node.parent = &tree->nil_node;
     tree->nil_node.flags = RBTREE_COLOR_BLACK;
+    return grew;
+}
+
+/**
+ * Join two red-black subtrees whose keys are all lower and all higher than
+ * node's key, using node to connect them. The subtrees' black heights are
+ * passed in, so they needn't be measured. The shorter subtree is hung from
+ * the spine of the taller one at the matching black height, then the red
+ * violation this may cause is repaired with insert_fixup(). Returns the new
+ * root, which is black and has nil_node as its parent, and stores its black
+ * height in height.
+ */
+static rbtree_node_t *join(rbtree_t *tree, rbtree_node_t *left, int left_height, rbtree_node_t *node, rbtree_node_t *right, int right_height, int *height) {
+    rbtree_node_t *nil = &tree->nil_node;
+    rbtree_node_t *root = tree->root;
+    rbtree_node_t *child;
+    rbtree_node_t *parent = nil;
+    rbtree_node_t *result;
+    int h;
+    // Blackening a red root adds one to its black height.
+    if (RBTREE_COLOR_IS_RED(left)) {
+        RBTREE_SET_BLACK(left);
+        left_height++;
+    }
+    if (RBTREE_COLOR_IS_RED(right)) {
+        RBTREE_SET_BLACK(right);
+        right_height++;
+    }
+    if (left_height == right_height) {
+        node->parent = nil;
+        node->left = left;
+        node->right = right;
+        if (left != nil) {
+            left->parent = node;
+        }
+        if (right != nil) {
+            right->parent = node;
+        }
+        RBTREE_SET_BLACK(node);
+        update_size(node);
+        if (tree->change_feed != NULL) {
+            update_max_version(node);
+        }
+        *height = left_height + 1;
+        return node;
+    }
+    if (left_height > right_height) {
+        child = left;
+        h = left_height;
+        while (RBTREE_COLOR_IS_RED(child) || h != right_height) {
+            if (RBTREE_COLOR_IS_BLACK(child)) {
+                h--;
+            }
+            parent = child;
+            child = child->right;
+        }
+        parent->right = node;
+        node->left = child;
+        node->right = right;
+        tree->root = left;
+    } else {
+        child = right;
+        h = right_height;
+        while (RBTREE_COLOR_IS_RED(child) || h != left_height) {
+            if (RBTREE_COLOR_IS_BLACK(child)) {
+                h--;
+            }
+            parent = child;
+            child = child->left;
+        }
+        parent->left = node;
+        node->left = left;
+        node->right = child;
+        tree->root = right;
+    }
+    node->parent = parent;
+    if (node->left != nil) {
+        node->left->parent = node;
+    }
+    if (node->right != nil) {
+        node->right->parent = node;
+    }
+    tree->root->parent = nil;
+    h = left_height > right_height ? left_height : right_height;
+    // The spine above node gains node and the shorter subtree.
+    update_size(node);
+    adjust_sizes(tree, parent, node->size - child->size, node->tombstones - child->tombstones);
+    if (tree->change_feed != NULL) {
+        update_max_version(node);
+        for (child = parent; child != nil; child = child->parent) {
+            if (RBTREE_VERSIONS(child)->max_version < RBTREE_VERSIONS(node)->max_version) {
+                RBTREE_VERSIONS(child)->max_version = RBTREE_VERSIONS(node)->max_version;
+            }
+        }
+    }
+    RBTREE_SET_RED(node);
+    *height = h + insert_fixup(tree, node);
+    result = tree->root;
+    tree->root = root;
+    return result;
+}
+
+static double link_distance(rbtree_t *tree, rbtree_node_t *node, unsigned long int *links) {
+    double distance = 0.0;
+    while (node != &tree->nil_node) {
+        if (node->left != &tree->nil_node) {
+            distance += labs((long int)((char *)node->left - (char *)node));
+            (*links)++;
+            distance += link_distance(tree, node->left, links);
+        }
+        if (node->right != &tree->nil_node) {
+            distance += labs((long int)((char *)node->right - (char *)node));
+            (*links)++;
+        }
+        node = node->right;
+    }
+    return distance;
+}
+
+/**
+ * Find the first node with a key not lower than key, or, if strict is set,
+ * higher than key. Returns nil_node if there is none. Tombstones are not
+ * skipped.
+ */
+static rbtree_node_t *lower_bound(rbtree_t *tree, void *key, int strict) {
+    rbtree_node_t *node = tree->root;
+    rbtree_node_t *bound = &tree->nil_node;
+    while (node != &tree->nil_node) {
+        int i = tree->cmp_func(key, node->key);
+        if (i < 0 || (i == 0 && !strict)) {
+            bound = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return bound;
+}
+
+/**
+ * Replace node with copy, which already holds a copy of node's fields, then
+ * free node.
+ */
+static void move_node(rbtree_t *tree, rbtree_node_t *node, rbtree_node_t *copy, rbtree_relocate_func_t relocate, rbtree_compact_stats_t *stats) {
+    unsigned long int released;
+    if (node->parent == &tree->nil_node) {
+        tree->root = copy;
+    } else if (node == node->parent->left) {
+        node->parent->left = copy;
+    } else {
+        node->parent->right = copy;
+    }
+    if (node->left != &tree->nil_node) {
+        node->left->parent = copy;
+    }
+    if (node->right != &tree->nil_node) {
+        node->right->parent = copy;
+    }
+    if (tree->leftmost == node) {
+        tree->leftmost = copy;
+    }
+    if (tree->rightmost == node) {
+        tree->rightmost = copy;
+    }
+    if (tree->lookup_cache != NULL) {
+        rbtree_node_t **slot = cache_slot(tree, node->key);
+        int i;
+        for (i = 0; i < RBTREE_CACHE_WAYS; i++) {
+            if (slot[i] == node) {
+                slot[i] = copy;
+            }
+        }
+    }
+    if (relocate != NULL) {
+        relocate(node, copy);
+    }
+    released = free_memory(node, node_size(tree));
+    if (stats != NULL) {
+        stats->nodes_moved++;
+        stats->bytes_released += released;
+    }
+}
+
+static rbtree_node_t *next_node(rbtree_t *tree, rbtree_node_t *node) {
+    rbtree_node_t *parent;
+    if (node->right != &tree->nil_node) {
+        node = node->right;
+        while (node->left != &tree->nil_node) {
+            node = node->left;
+        }
+        return node;
+    }
+    parent = node->parent;
+    while (parent != &tree->nil_node && node == parent->right) {
+        node = parent;
+        parent = parent->parent;
+    }
+    return parent;
+}
+
+static rbtree_node_t *next_preorder(rbtree_t *tree, rbtree_node_t *node) {
+    rbtree_node_t *parent;
+    if (node->left != &tree->nil_node) {
+        return node->left;
+    }
+    if (node->right != &tree->nil_node) {
+        return node->right;
+    }
+    parent = node->parent;
+    while (parent != &tree->nil_node) {
+        if (node == parent->left && parent->right != &tree->nil_node) {
+            return parent->right;
+        }
+        node = parent;
+        parent = parent->parent;
+    }
+    return parent;
+}
+
+static size_t node_size(rbtree_t *tree) {
+    return tree->change_feed != NULL ? sizeof(versioned_node_t) : sizeof(rbtree_node_t);
+}
+
+static rbtree_node_t *prev_node(rbtree_t *tree, rbtree_node_t *node) {
+    rbtree_node_t *parent;
+    if (node->left != &tree->nil_node) {
+        node = node->left;
+        while (node->right != &tree->nil_node) {
+            node = node->right;
+        }
+        return node;
+    }
+    parent = node->parent;
+    while (parent != &tree->nil_node && node == parent->left) {
+        node = parent;
+        parent = parent->parent;
+    }
+    return parent;
+}
+
+/**
+ * Restore the rank rule after a removal under the WAVL or AVL policy. x (which
+ * may be the nil node) has parent p and a rank difference of x_diff, which
+ * may be 3 here even though only 1 and 2 can be stored. Demotions can move
+ * the problem up the tree, but WAVL finishes with at most two rotations.
+ * AVL, which also forbids 2,2 nodes, may rotate all the way up.
+ */
+static void rank_delete_fixup(rbtree_t *tree, rbtree_node_t *x, rbtree_node_t *p, int x_diff) {
+    while (p != &tree->nil_node) {
+        rbtree_node_t *s = x == p->left ? p->right : p->left;
+        int p_diff = RBTREE_RANK_DIFF(p, p->parent);
+        if (x_diff == 2) {
+            // p is only wrong if it became a 2,2 node, which WAVL allows
+            // except for leaves.
+            if (RBTREE_RANK_DIFF(s, p) != 2 || (tree->policy == RBTREE_POLICY_WAVL && (p->left != &tree->nil_node || p->right != &tree->nil_node))) {
+                return;
+            }
+            RBTREE_FLIP_RANK(p);
+        } else if (RBTREE_RANK_DIFF(s, p) == 2) {
+            RBTREE_FLIP_RANK(p);
+        } else if (tree->policy == RBTREE_POLICY_WAVL && RBTREE_RANK_DIFF(s->left, s) == 2 && RBTREE_RANK_DIFF(s->right, s) == 2) {
+            RBTREE_FLIP_RANK(p);
+            RBTREE_FLIP_RANK(s);
+        } else {
+            int left = x == p->left;
+            rbtree_node_t *outer = left ? s->right : s->left;
+            rbtree_node_t *inner = left ? s->left : s->right;
+            if (RBTREE_RANK_DIFF(outer, s) == 1) {
+                int inner_diff = RBTREE_RANK_DIFF(inner, s);
+                if (left) {
+                    rotate_left(tree, p);
+                } else {
+                    rotate_right(tree, p);
+                }
+                if (tree->policy == RBTREE_POLICY_AVL && inner_diff == 2) {
+                    // p drops two ranks and s keeps its rank, so the
+                    // subtree is one lower than before.
+                    x = s;
+                    p = s->parent;
+                    x_diff = p_diff + 1;
+                    continue;
+                }
+                RBTREE_FLIP_RANK(s);
+                RBTREE_FLIP_RANK(p);
+                if (p->left == &tree->nil_node && p->right == &tree->nil_node) {
+                    RBTREE_FLIP_RANK(p);
+                }
+                return;
+            }
+            if (left) {
+                rotate_right(tree, s);
+                rotate_left(tree, p);
+            } else {
+                rotate_left(tree, s);
+                rotate_right(tree, p);
+            }
+            RBTREE_FLIP_RANK(s);
+            if (tree->policy == RBTREE_POLICY_WAVL) {
+                // inner rises two ranks and p drops two, so neither parity
+                // changes.
+                return;
+            }
+            RBTREE_FLIP_RANK(inner);
+            x = inner;
+            p = inner->parent;
+            x_diff = p_diff + 1;
+            continue;
+        }
+        // p was demoted.
+        x = p;
+        p = p->parent;
+        x_diff = p_diff + 1;
+    }
+}
+
+/**
+ * Restore the rank rule after an insertion under the WAVL or AVL policy, which
+ * rebalance insertions the same way. x has the same rank as its parent.
+ */
+static void rank_insert_fixup(rbtree_t *tree, rbtree_node_t *x) {
+    rbtree_node_t *p = x->parent;
+    // Matching parity here means x has reached p's rank, since the
+    // difference was 1 or 2 before x was added or promoted.
+    while (p != &tree->nil_node && RBTREE_RANK_DIFF(x, p) == 2) {
+        rbtree_node_t *s = x == p->left ? p->right : p->left;
+        rbtree_node_t *z;
+        if (RBTREE_RANK_DIFF(s, p) == 1) {
+            RBTREE_FLIP_RANK(p);
+            x = p;
+            p = x->parent;
+            continue;
+        }
+        z = x == p->left ? x->right : x->left;
+        if (RBTREE_RANK_DIFF(z, x) == 2) {
+            if (x == p->left) {
+                rotate_right(tree, p);
+            } else {
+                rotate_left(tree, p);
+            }
+            RBTREE_FLIP_RANK(p);
+        } else {
+            if (x == p->left) {
+                rotate_left(tree, x);
+                rotate_right(tree, p);
+            } else {
+                rotate_right(tree, x);
+                rotate_left(tree, p);
+            }
+            RBTREE_FLIP_RANK(z);
+            RBTREE_FLIP_RANK(x);
+            RBTREE_FLIP_RANK(p);
+        }
+        return;
+    }
+}
+
+/**
+ * Add a removal to the change feed, overwriting the oldest entry if the ring
+ * is full. Changes up to the overwritten one can no longer all be reported.
+ */
+static void record_change(rbtree_t *tree, int change, void *key) {
+    change_feed_t *feed = tree->change_feed;
+    change_t *entry;
+    if (feed->count == feed->capacity) {
+        entry = &feed->changes[feed->first];
+        if (feed->key_free != NULL && entry->key != NULL) {
+            feed->key_free(entry->key);
+        }
+        tree->resync_version = entry->version;
+        feed->first = (feed->first + 1) % feed->capacity;
+        feed->count--;
+    }
+    tree->version++;
+    entry = &feed->changes[(feed->first + feed->count) % feed->capacity];
+    entry->change = change;
+    entry->key = key;
+    entry->version = tree->version;
+    if (key != NULL && feed->key_dup != NULL) {
+        entry->key = feed->key_dup(key);
+        if (entry->key == NULL) {
+            tree->resync_version = tree->version;
+            return;
+        }
+    }
+    feed->count++;
+}
+
+static void *reclaim_thread(void *arg) {
+    rbtree_reclaim_step(arg, ULONG_MAX);
+    return NULL;
+}
+
+static void remove_node(rbtree_t *tree, rbtree_node_t *node) {
+    rbtree_node_t *n;
+    rbtree_node_t *x;
+    rbtree_node_t *y = node;
+    uint32_t color = y->flags & RBTREE_COLOR_MASK;
+    int y_diff = RBTREE_RANK_DIFF(y, y->parent);
+    cache_forget(tree, node);
+    if (node == tree->leftmost) {
+        if (node->right != &tree->nil_node) {
+            tree->leftmost = rbtree_minimum(tree, node->right);
+        } else {
+            tree->leftmost = node->parent;
+        }
+    }
+    if (node == tree->rightmost) {
+        if (node->left != &tree->nil_node) {
+            tree->rightmost = rbtree_maximum(tree, node->left);
+        } else {
+            tree->rightmost = node->parent;
+        }
+    }
+    if (node->left == &tree->nil_node) {
+        x = node->right;
+        transplant(tree, node, node->right);
+    } else if (node->right == &tree->nil_node) {
+        x = node->left;
+        transplant(tree, node, node->left);
+    } else {
+        y = rbtree_minimum(tree, node->right);
+        color = y->flags & RBTREE_COLOR_MASK;
+        y_diff = RBTREE_RANK_DIFF(y, y->parent);
+        x = y->right;
+        if (y->parent == node) {
+            x->parent = y;
+        } else {
+            transplant(tree, y, y->right);
+            y->right = node->right;
+            y->right->parent = y;
+        }
+        transplant(tree, node, y);
+        y->left = node->left;
+        y->left->parent = y;
+        y->flags &= ~RBTREE_COLOR_MASK;
+        y->flags |= node->flags & RBTREE_COLOR_MASK;
+    }
+    for (n = x->parent; n != &tree->nil_node; n = n->parent) {
+        update_size(n);
+        if (tree->change_feed != NULL) {
+            update_max_version(n);
+        }
+    }
+    if (tree->policy != RBTREE_POLICY_RB) {
+        // x has taken the place of y, one rank lower.
+        rank_delete_fixup(tree, x, x->parent, y_diff + 1);
+    } else if (color == 0) {
+        delete_fixup(tree, x);
+    }
+    if (RBTREE_IS_TOMBSTONE(node)) {
+        tree->tombstone_count--;
+    } else {
+        tree->node_count--;
+    }
+    if (node == tree->compact_cursor) {
+        tree->compact_cursor = tree->root;
+    }
+}
+
+static void replace_node(rbtree_t *tree, rbtree_node_t *old, rbtree_node_t *node) {
+    node->parent = old->parent;
+    node->left = old->left;
+    node->right = old->right;
+    node->flags = (node->flags & RBTREE_USER_MASK) | (old->flags & RBTREE_COLOR_MASK);
+    node->size = old->size;
+    node->tombstones = old->tombstones;
+    if (old->parent == &tree->nil_node) {
+        tree->root = node;
+    } else if (old == old->parent->left) {
+        old->parent->left = node;
+    } else {
+        old->parent->right = node;
+    }
+    if (node->left != &tree->nil_node) {
+        node->left->parent = node;
+    }
+    if (node->right != &tree->nil_node) {
+        node->right->parent = node;
+    }
+    if (tree->leftmost == old) {
+        tree->leftmost = node;
+    }
+    if (tree->rightmost == old) {
+        tree->rightmost = node;
+    }
+    if (tree->compact_cursor == old) {
+        tree->compact_cursor = node;
+    }
 }
 
 static void rotate_left(rbtree_t *tree, rbtree_node_t *x) {
     rbtree_node_t *y = x->right;
+    tree->rotations++;
     x->right = y->left;
     if (y->left != &tree->nil_node) {
         y->left->parent = x;
@@ -389,10 +1991,18 @@ static void rotate_left(rbtree_t *tree, rbtree_node_t *x) {
     }
     y->left = x;
     x->parent = y;
+    y->size = x->size;
+    y->tombstones = x->tombstones;
+    update_size(x);
+    if (tree->change_feed != NULL) {
+        RBTREE_VERSIONS(y)->max_version = RBTREE_VERSIONS(x)->max_version;
+        update_max_version(x);
+    }
 }
 
 static void rotate_right(rbtree_t *tree, rbtree_node_t *x) {
     rbtree_node_t *y = x->left;
+    tree->rotations++;
     x->left = y->right;
     if (y->right != &tree->nil_node) {
         y->right->parent = x;
@@ -407,6 +2017,82 @@ static void rotate_right(rbtree_t *tree, rbtree_node_t *x) {
     }
     y->right = x;
     x->parent = y;
+    y->size = x->size;
+    y->tombstones = x->tombstones;
+    update_size(x);
+    if (tree->change_feed != NULL) {
+        RBTREE_VERSIONS(y)->max_version = RBTREE_VERSIONS(x)->max_version;
+        update_max_version(x);
+    }
+}
+
+/**
+ * Move every node in the subtree with a key lower than key onto the detached
+ * list and return what remains as a valid red-black subtree. Each detached
+ * node keeps its left subtree and is chained to the next one through its
+ * right pointer. Detached nodes are counted from the subtree sizes, so only
+ * one path is visited. height is the black height of node, and the black
+ * height of the result is stored in result_height.
+ */
+static rbtree_node_t *split_below(rbtree_t *tree, rbtree_node_t *node, int height, void *key, rbtree_detached_t *detached, int *result_height) {
+    rbtree_node_t *left;
+    int left_height;
+    unsigned long int size = 0;
+    unsigned long int tombstones = 0;
+    while (node != &tree->nil_node && tree->cmp_func(node->key, key) < 0) {
+        rbtree_node_t *right = node->right;
+        size += node->size - right->size;
+        tombstones += node->tombstones - right->tombstones;
+        if (RBTREE_COLOR_IS_BLACK(node)) {
+            height--;
+        }
+        node->right = detached->root;
+        detached->root = node;
+        node = right;
+    }
+    tree->node_count -= size - tombstones;
+    tree->tombstone_count -= tombstones;
+    detached->node_count += size;
+    if (node == &tree->nil_node) {
+        *result_height = 0;
+        return node;
+    }
+    if (RBTREE_COLOR_IS_BLACK(node)) {
+        height--;
+    }
+    left = split_below(tree, node->left, height, key, detached, &left_height);
+    return join(tree, left, left_height, node, node->right, height, result_height);
+}
+
+/**
+ * Give a node the next version and raise the max_version of the node and
+ * its ancestors to it.
+ */
+static void stamp_node(rbtree_t *tree, rbtree_node_t *node) {
+    RBTREE_VERSIONS(node)->version = ++tree->version;
+    while (node != &tree->nil_node) {
+        RBTREE_VERSIONS(node)->max_version = tree->version;
+        node = node->parent;
+    }
+}
+
+static int subtree_height(rbtree_t *tree, rbtree_node_t *node) {
+    int left;
+    int right;
+    if (node == &tree->nil_node) {
+        return 0;
+    }
+    left = subtree_height(tree, node->left);
+    right = subtree_height(tree, node->right);
+    return 1 + (left > right ? left : right);
+}
+
+/**
+ * The highest version in a subtree. The nil node has no room for versions,
+ * and is told apart by being the only node with a size of 0.
+ */
+static uint64_t subtree_max_version(rbtree_node_t *node) {
+    return node->size != 0 ? RBTREE_VERSIONS(node)->max_version : 0;
 }
 
 static void transplant(rbtree_t *tree, rbtree_node_t *u, rbtree_node_t *v) {
@@ -419,3 +2105,39 @@ static void transplant(rbtree_t *tree, rbtree_node_t *u, rbtree_node_t *v) {
     }
     v->parent = u->parent;
 }
+
+/**
+ * Remove the tombstones at either end of the tree, so that leftmost and
+ * rightmost are always live and rbtree_first() and rbtree_last() stay O(1)
+ * under lazy deletion. Each tombstone is only removed once, so this costs
+ * O(log n) per deletion, amortized.
+ */
+static void trim_ends(rbtree_t *tree) {
+    rbtree_node_t *node;
+    while (tree->tombstone_count != 0 && RBTREE_IS_TOMBSTONE(tree->leftmost)) {
+        node = tree->leftmost;
+        remove_node(tree, node);
+        destroy_node(tree, node);
+    }
+    while (tree->tombstone_count != 0 && RBTREE_IS_TOMBSTONE(tree->rightmost)) {
+        node = tree->rightmost;
+        remove_node(tree, node);
+        destroy_node(tree, node);
+    }
+}
+
+static void update_max_version(rbtree_node_t *node) {
+    uint64_t max_version = RBTREE_VERSIONS(node)->version;
+    if (subtree_max_version(node->left) > max_version) {
+        max_version = subtree_max_version(node->left);
+    }
+    if (subtree_max_version(node->right) > max_version) {
+        max_version = subtree_max_version(node->right);
+    }
+    RBTREE_VERSIONS(node)->max_version = max_version;
+}
+
+static void update_size(rbtree_node_t *node) {
+    node->size = node->left->size + node->right->size + 1;
+    node->tombstones = node->left->tombstones + node->right->tombstones + (RBTREE_IS_TOMBSTONE(node) ? 1 : 0);
+}
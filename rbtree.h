@@ -11,26 +11,44 @@
 #ifndef _RBTREE_H
 #define _RBTREE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
- * @brief flags field is used for color tracking. The remaining bits can be 
- * used by the application for whatever it wants and won't be modified by the
- * rbtree code. This user data can be accessed with RBTREE_SET_USER(n, d), 
+ * @brief flags field is used for color tracking, for marking nodes that
+ * have been deleted lazily (tombstones) and for marking nodes that were
+ * moved into arena storage by compaction. The remaining bits can be used by
+ * the application for whatever it wants and won't be modified by the rbtree
+ * code. This user data can be accessed with RBTREE_SET_USER(n, d), 
  * RBTREE_GET_USER(n) and the RBTREE_USER_MASK bit mask.
+ *
+ * API change: earlier versions reserved only the color bit and left 31 user
+ * bits. The three bits of RBTREE_RESERVED_MASK are now reserved, leaving 29
+ * user bits. Applications that stored data in bits 29 and 30 must move it.
  */
 #define RBTREE_COLOR_MASK           0x80000000
-#define RBTREE_USER_MASK            0x7fffffff
+#define RBTREE_TOMBSTONE_MASK       0x40000000
+#define RBTREE_ARENA_MASK           0x20000000
+#define RBTREE_RESERVED_MASK        0xe0000000
+#define RBTREE_USER_MASK            ((uint32_t)~RBTREE_RESERVED_MASK)
 #define RBTREE_COLOR_BLACK          0x00000000
 #define RBTREE_COLOR_RED            0x80000000
 #define RBTREE_COLOR(n)             ((n)->flags & RBTREE_COLOR_MASK)
 #define RBTREE_COLOR_IS_BLACK(n)    (RBTREE_COLOR(n) == RBTREE_COLOR_BLACK)
 #define RBTREE_COLOR_IS_RED(n)      (RBTREE_COLOR(n) == RBTREE_COLOR_RED)
-#define RBTREE_SET_BLACK(n)         (n)->flags &= RBTREE_USER_MASK
+#define RBTREE_SET_BLACK(n)         (n)->flags &= ~RBTREE_COLOR_MASK
 #define RBTREE_SET_RED(n)           (n)->flags |= RBTREE_COLOR_RED
-#define RBTREE_SET_USER(n, d)       (n)->flags = ((n)->flags & RBTREE_COLOR_MASK) | ((uint32_t)d & RBTREE_USER_MASK)
+#define RBTREE_IS_TOMBSTONE(n)      (((n)->flags & RBTREE_TOMBSTONE_MASK) != 0)
+#define RBTREE_SET_USER(n, d)       (n)->flags = ((n)->flags & ~RBTREE_USER_MASK) | ((uint32_t)d & RBTREE_USER_MASK)
 #define RBTREE_GET_USER(n)          ((n)->flags & RBTREE_USER_MASK)
 
+/**
+ * @brief Recover a pointer to the structure of the given type that embeds the
+ * rbtree_node_t pointed to by ptr as the field named member. This is used
+ * with trees created by rbtree_new_intrusive().
+ */
+#define RBTREE_ENTRY(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
 /**
  * @brief A red-black tree node structure. The data field is not referenced by
  * the rbtree code in any way. The parent, left and right fields should not be
@@ -46,14 +64,20 @@ typedef struct rbtree_node_t {
     struct rbtree_node_t *left;
     /// @brief Subtree with keys having a higher ordinal value than this node.
     struct rbtree_node_t *right;
-    /// @brief Highest-order bit is used for red-black tracking, other bits are
-    /// are zeroed upon node creation, then never again altered by the
-    /// rbtree code and may be used by the application if desired.
+    /// @brief The three highest-order bits are used for red-black tracking,
+    /// tombstones and arena storage, other bits are zeroed upon node
+    /// creation, then never again altered by the rbtree code and may be used
+    /// by the application if desired.
     uint32_t flags;
+    /// @brief Number of nodes, tombstones included, in the subtree rooted at
+    /// this node.
+    uint32_t size;
     /// @brief The key value used to order the nodes.
     void *key;
     /// @brief Application data.
     void *data;
+    /// @brief Number of tombstones in the subtree rooted at this node.
+    uint32_t tombstones;
 } rbtree_node_t;
 
 /**
@@ -81,6 +105,105 @@ typedef void (*rbtree_node_delete_func_t)(rbtree_node_t *node);
  */
 typedef int (*rbtree_traverse_func_t)(rbtree_node_t *node);
 
+/**
+ * @brief Function called when compaction moves a node, so the application can
+ * update any pointers it holds to it. The old node's memory is still valid
+ * during the call and is freed right after it.
+ */
+typedef void (*rbtree_relocate_func_t)(rbtree_node_t *old_node, rbtree_node_t *new_node);
+
+/**
+ * @brief Statistics filled in by rbtree_compact() and rbtree_compact_step().
+ * Link distance is the mean number of bytes between a node and each of its
+ * children, which is only measured by rbtree_compact().
+ */
+typedef struct rbtree_compact_stats_t {
+    /// @brief Nodes moved into arena storage.
+    unsigned long int nodes_moved;
+    /// @brief Bytes of arena storage allocated.
+    unsigned long int bytes_allocated;
+    /// @brief Bytes of node memory and emptied arenas released.
+    unsigned long int bytes_released;
+    /// @brief Mean parent to child distance in bytes before compacting.
+    double link_distance_before;
+    /// @brief Mean parent to child distance in bytes after compacting.
+    double link_distance_after;
+} rbtree_compact_stats_t;
+
+/**
+ * @brief Hashes a key for the lookup cache. Keys that compare equal must
+ * hash to the same value.
+ */
+typedef uint64_t (*rbtree_key_hash_func_t)(void *key);
+
+/**
+ * @brief Change feed callbacks that copy and free keys recorded as removed,
+ * since a removed key may be freed by del_func before it is reported.
+ */
+typedef void *(*rbtree_key_dup_func_t)(void *key);
+typedef void (*rbtree_key_free_func_t)(void *key);
+
+/**
+ * @brief Kinds of change reported by rbtree_changes_since().
+ */
+#define RBTREE_CHANGE_UPSERT        1
+#define RBTREE_CHANGE_DELETE        2
+#define RBTREE_CHANGE_EXPIRE        3
+#define RBTREE_CHANGE_CLEAR         4
+
+/**
+ * @brief Called by rbtree_changes_since() for each change. UPSERT reports a
+ * key that was inserted or whose data was set, with its current data.
+ * DELETE reports a removed key, EXPIRE the key passed to
+ * rbtree_expire_before(), and CLEAR (with a NULL key) the removal of every
+ * node. Returning non-zero stops the report.
+ */
+typedef int (*rbtree_change_func_t)(int change, void *key, void *data);
+
+/**
+ * @brief Balancing policies for rbtree_new_with_policy(). RB is the classic
+ * red-black tree. WAVL (weak AVL) trees are as fast to update, and are no
+ * taller than AVL trees while only insertions are made. AVL trees are the
+ * most tightly balanced but rotate more on removal. Under WAVL and AVL the
+ * color bit of a node's flags holds the parity of its rank instead of its
+ * color.
+ */
+#define RBTREE_POLICY_RB            0
+#define RBTREE_POLICY_WAVL          1
+#define RBTREE_POLICY_AVL           2
+
+/**
+ * @brief Size of the buffer in which journal records are collected before
+ * they are written to the log.
+ */
+#define RBTREE_JOURNAL_BUFFER_SIZE  65536
+
+/**
+ * @brief Serializes keys and data for the journal. Each encode function
+ * writes its value to buf, if it fits in size bytes, and returns the number
+ * of bytes the value needs. If that is more than size, it is called again
+ * with a larger buffer. Each decode function returns a new key or data
+ * object built from len bytes at buf, which the tree's del_func must be
+ * able to free.
+ */
+typedef struct rbtree_codec_t {
+    /// @brief Serializes a key. Required.
+    size_t (*encode_key)(void *key, void *buf, size_t size);
+    /// @brief Rebuilds a key. Required.
+    void *(*decode_key)(const void *buf, size_t len);
+    /// @brief Serializes data. If NULL, data isn't journaled and is
+    /// recovered as NULL.
+    size_t (*encode_data)(void *data, void *buf, size_t size);
+    /// @brief Rebuilds data.
+    void *(*decode_data)(const void *buf, size_t len);
+} rbtree_codec_t;
+
+/**
+ * @brief The write-ahead journal of a tree, opened with
+ * rbtree_journal_open(). The structure is opaque.
+ */
+typedef struct rbtree_journal_t rbtree_journal_t;
+
 /** 
  * @brief A red-black tree. This structure tracks the tree root (which will 
  * change as nodes are added), the key comparison and node delete functions 
@@ -89,6 +212,12 @@ typedef int (*rbtree_traverse_func_t)(rbtree_node_t *node);
 typedef struct rbtree_t {
     /// @brief The root of the red-black tree.
     rbtree_node_t *root;
+    /// @brief The node with the lowest ordinal key, maintained as nodes are
+    /// inserted and deleted. Points to nil_node when the tree is empty.
+    rbtree_node_t *leftmost;
+    /// @brief The node with the highest ordinal key, maintained as nodes are
+    /// inserted and deleted. Points to nil_node when the tree is empty.
+    rbtree_node_t *rightmost;
     /// @brief Callback function for comparing key values.
     rbtree_key_compare_func_t cmp_func;
     /// @brief Callback function allowing application to delete its key and 
@@ -96,10 +225,191 @@ typedef struct rbtree_t {
     rbtree_node_delete_func_t del_func;
     /// @brief NIL node used by the red-black tree code.
     rbtree_node_t nil_node;
-    /// @brief The number of nodes in the tree.
+    /// @brief The number of nodes in the tree, not counting tombstones.
     unsigned long int node_count;
+    /// @brief The number of tombstoned nodes still linked into the tree.
+    unsigned long int tombstone_count;
+    /// @brief Percentage of tombstones, relative to all nodes linked into the
+    /// tree, at which they are purged. Zero means lazy deletion is disabled.
+    unsigned int purge_ratio;
+    /// @brief Non-zero if the nodes are embedded in application structures
+    /// and are never allocated or freed by the tree.
+    int intrusive;
+    /// @brief Next node to be visited by an unfinished compaction, or NULL.
+    rbtree_node_t *compact_cursor;
+    /// @brief Arena block currently being filled by compaction.
+    void *compact_arena;
+    /// @brief Counts compaction passes, so nodes already moved by the current
+    /// pass can be recognised.
+    unsigned long int compact_generation;
+    /// @brief NUMA node that node memory is allocated on, or -1 to allocate
+    /// nodes with malloc().
+    int numa_node;
+    /// @brief Arena block new nodes are allocated from when numa_node is set.
+    void *insert_arena;
+    /// @brief Journal that changes are recorded in, or NULL.
+    rbtree_journal_t *journal;
+    /// @brief Set associative cache of looked up nodes, indexed by key
+    /// hash, or NULL.
+    rbtree_node_t **lookup_cache;
+    /// @brief The number of cache sets, a power of two, minus one.
+    unsigned long int cache_mask;
+    /// @brief Hashes keys for the cache. NULL hashes the key pointer itself.
+    rbtree_key_hash_func_t cache_hash;
+    /// @brief Lookups answered from the cache.
+    unsigned long int cache_hits;
+    /// @brief Lookups that had to search the tree.
+    unsigned long int cache_misses;
+    /// @brief One of the RBTREE_POLICY_ balancing policies.
+    int policy;
+    /// @brief Rotations made while rebalancing the tree.
+    unsigned long int rotations;
+    /// @brief Ring of recorded removals, or NULL if the tree has no change
+    /// feed.
+    void *change_feed;
+    /// @brief Incremented on every change while the tree has a change feed.
+    uint64_t version;
+    /// @brief The oldest version rbtree_changes_since() can report from.
+    uint64_t resync_version;
 } rbtree_t;
 
+/**
+ * @brief A set of nodes that has been cut out of a tree and is waiting to be
+ * destroyed. The nodes are destroyed by rbtree_reclaim_step(), either
+ * directly or from a background thread started by
+ * rbtree_reclaim_background(). The tree the nodes came from may be used,
+ * or freed, while this happens.
+ */
+typedef struct rbtree_detached_t {
+    /// @brief The remaining detached nodes.
+    rbtree_node_t *root;
+    /// @brief The NIL node of the tree the nodes were detached from. It is
+    /// only compared against, never dereferenced.
+    rbtree_node_t *nil;
+    /// @brief The del_func of the tree the nodes were detached from.
+    rbtree_node_delete_func_t del_func;
+    /// @brief Called instead of del_func for each node that isn't a
+    /// tombstone. If NULL, del_func is used for every node.
+    rbtree_node_delete_func_t expire_func;
+    /// @brief The number of nodes still to be destroyed.
+    unsigned long int node_count;
+    /// @brief Non-zero if the nodes must not be freed.
+    int intrusive;
+} rbtree_detached_t;
+
+#define RBTREE_EXPORT_BEGIN         0
+#define RBTREE_EXPORT_FROM          1
+#define RBTREE_EXPORT_AFTER         2
+#define RBTREE_EXPORT_END           3
+
+/**
+ * @brief Where rbtree_export() starts, and where the next call resumes. Set
+ * state to RBTREE_EXPORT_BEGIN to start at the lowest key, or to
+ * RBTREE_EXPORT_FROM to start at key. rbtree_export() leaves it as
+ * RBTREE_EXPORT_AFTER the last key exported, or RBTREE_EXPORT_END once the
+ * highest key has been exported. Since the position is kept as a key, the
+ * tree may be modified between calls. The token doesn't copy the key: it
+ * points at the key of the last node exported, and the caller must keep
+ * that key valid until the next call. If that node may be deleted in the
+ * meantime and the del_func frees its key, copy the key to storage the
+ * caller owns and point key at the copy first.
+ */
+typedef struct rbtree_export_token_t {
+    /// @brief The key to start from, or the last key exported. Borrowed,
+    /// not copied.
+    void *key;
+    /// @brief One of the RBTREE_EXPORT_ values.
+    int state;
+} rbtree_export_token_t;
+
+/**
+ * @brief Number of queued writes after which a replicated tree applies them
+ * to its replicas without waiting for rbtree_replicated_commit().
+ */
+#define RBTREE_REPLICA_BATCH 1024
+
+/**
+ * @brief Describes the NUMA layout to rbtree_replicated_new(). Mostly useful
+ * for testing, since the layout is normally read from the system.
+ */
+typedef struct rbtree_topology_t {
+    /// @brief Number of NUMA nodes. One replica is kept per node.
+    int node_count;
+    /// @brief Returns the NUMA node of the calling thread. If NULL, the
+    /// node of the CPU the thread is running on is used.
+    int (*current_node)(void);
+} rbtree_topology_t;
+
+/**
+ * @brief A read-mostly tree replicated once per NUMA node. Readers use the
+ * replica on their own node. Writes are queued and applied to every replica
+ * in a batch. The structure is opaque.
+ */
+typedef struct rbtree_replicated_t rbtree_replicated_t;
+
+/**
+ * @brief Report the changes made to a tree with a change feed since it was
+ * at the given version. Removals are reported first, in the order they were
+ * made, then keys inserted or updated since, in key order. Applying them in
+ * that order to a copy of the tree as it was at version brings the copy up
+ * to date. Unchanged subtrees are skipped, so this takes O(k log n) for k
+ * changes. Read tree->version first to know where the next call should
+ * start from.
+ * @param tree The rbtree.
+ * @param version A version of the tree, usually tree->version when it was
+ * last copied.
+ * @param cb Called for each change.
+ * @return 0 when all changes were reported, non-zero if cb stopped the
+ * report, or -1 if the tree has no change feed or the changes since version
+ * are no longer all known, in which case the copy must be rebuilt from the
+ * whole tree.
+ */
+extern int rbtree_changes_since(rbtree_t *tree, uint64_t version, rbtree_change_func_t cb);
+
+/**
+ * @brief Write a checkpoint of a journaled tree and empty its log. Normally
+ * only the latest change to each key modified since the previous checkpoint
+ * is appended to the checkpoint file, so the cost depends on the number of
+ * keys changed, not on the size of the tree. After rbtree_expire_before(),
+ * rbtree_detach_all() or rbtree_delete() of the whole tree, or once the
+ * appended changes outgrow the rest of the file, the checkpoint file is
+ * rewritten from the whole tree instead.
+ * @param tree The journaled rbtree.
+ * @return 0 on success, -1 on error, in which case the log is kept.
+ */
+extern int rbtree_checkpoint(rbtree_t *tree);
+
+/**
+ * @brief Move every node of the tree into contiguous arena storage in
+ * preorder, so that walking down the tree touches neighbouring memory. The
+ * parent, left and right links are rewritten as nodes move. Nodes are
+ * allocated normally again afterwards. An arena block is returned to the
+ * system once all of its nodes have been deleted or moved by a later
+ * compaction. Intrusive trees can't be compacted.
+ * @param tree The rbtree to be compacted.
+ * @param relocate Called for each node moved, if not NULL.
+ * @param stats Filled in with statistics about the compaction, if not NULL.
+ * @return 0 on success, -1 if memory allocation failed or the tree is
+ * intrusive.
+ */
+extern int rbtree_compact(rbtree_t *tree, rbtree_relocate_func_t relocate, rbtree_compact_stats_t *stats);
+
+/**
+ * @brief Do a bounded amount of the work of rbtree_compact(). Each call
+ * visits at most budget nodes and continues where the previous call stopped.
+ * If the tree changes between calls, the pass goes on from the current tree
+ * shape. Nodes that end up behind the cursor because of those changes stay
+ * where they are until the next pass. The link distance statistics are not
+ * measured.
+ * @param tree The rbtree to be compacted.
+ * @param budget The maximum number of nodes to visit.
+ * @param relocate Called for each node moved, if not NULL.
+ * @param stats Filled in with statistics about this step, if not NULL.
+ * @return 1 if the pass isn't finished, 0 if it is, -1 if memory allocation
+ * failed or the tree is intrusive.
+ */
+extern int rbtree_compact_step(rbtree_t *tree, unsigned long int budget, rbtree_relocate_func_t relocate, rbtree_compact_stats_t *stats);
+
 /** 
  * @brief Delete the entire sub-tree structure rooted at subtree. If subtree
  * is NULL, the entire red-black tree is deallocated and the rbtree_t 
@@ -114,12 +424,25 @@ extern void rbtree_delete(rbtree_t *tree, rbtree_node_t *node);
 /** 
  * @brief Delete a node from the tree. The del_func, if not NULL, will be 
  * called with the given node as the argument before the node itself is 
- * deleted.
+ * deleted. If lazy deletion is enabled, the node is only marked as a
+ * tombstone and del_func is called later, when it is purged.
  * @param tree The rbtree containing the node to be deleted.
  * @param node The node to be deleted.
  */
 extern void rbtree_delete_node(rbtree_t *tree, rbtree_node_t *node);
 
+/**
+ * @brief Detach every node of the tree at once, leaving it empty. This takes
+ * constant time however large the tree is. The nodes are destroyed later,
+ * with their del_func, by rbtree_reclaim_step() or
+ * rbtree_reclaim_background(), so a large tree can be torn down without a
+ * long pause. The tree may be reused, or freed, in the meantime.
+ * @param tree The rbtree to be emptied.
+ * @return The detached node set, or NULL if the tree is empty or memory
+ * allocation failed, in which case the tree is unchanged.
+ */
+extern rbtree_detached_t *rbtree_detach_all(rbtree_t *tree);
+
 /**
  * @brief Delete all nodes in the tree and frees memory allocated to the tree
  * structure.
@@ -127,28 +450,151 @@ extern void rbtree_delete_node(rbtree_t *tree, rbtree_node_t *node);
  */
 extern void rbtree_free(rbtree_t *tree);
 
+/**
+ * @brief Detach every node with a key lower than the given key, as when
+ * expiring entries from a tree keyed by expiry time. The tree is split along
+ * a single root-to-leaf path and rebalanced by joining subtrees, and the
+ * detached nodes are counted from the subtree sizes kept in the nodes, so
+ * this takes O(log n) however many nodes expire. They are destroyed later
+ * with rbtree_reclaim_step() or rbtree_reclaim_background(). Splitting and
+ * joining only keep red-black trees balanced, so trees using the WAVL or
+ * AVL policy instead remove the expired nodes one at a time, which takes
+ * O(k log n) for k expired nodes.
+ * @param tree The rbtree to expire nodes from.
+ * @param key Nodes with keys lower than this are detached.
+ * @param cb Called with each detached node as it is destroyed, instead of
+ * the del_func. Tombstones are still passed to the del_func. If NULL, the
+ * del_func is used for every node.
+ * @return The detached node set, or NULL if no node has a key lower than
+ * key or memory allocation failed, in which case the tree is unchanged.
+ */
+extern rbtree_detached_t *rbtree_expire_before(rbtree_t *tree, void *key, rbtree_node_delete_func_t cb);
+
+/**
+ * @brief Copy up to max keys and their data, in ascending order, into
+ * buffers supplied by the caller. The start is found in O(log n) from the
+ * token, which is then updated so that the next call carries on where this
+ * one stopped. Tombstones are skipped. No memory is allocated.
+ * @param tree The rbtree to export from.
+ * @param token The position to start from, updated on return.
+ * @param keys_out Receives the keys. May be NULL.
+ * @param data_out Receives the data. May be NULL.
+ * @param max The number of entries the buffers have room for.
+ * @return The number of entries exported. 0 means there are no more.
+ */
+extern unsigned long int rbtree_export(rbtree_t *tree, rbtree_export_token_t *token, void **keys_out, void **data_out, unsigned long int max);
+
+/**
+ * @brief Return the node with the lowest ordinal key in the tree. The node is
+ * cached in the tree structure, so this is O(1).
+ * @param tree The rbtree to be queried.
+ * @return A pointer to the node with the lowest ordinal key or NULL if the
+ * tree is empty.
+ */
+extern rbtree_node_t *rbtree_first(rbtree_t *tree);
+
 /**
  * @brief Returns a pointer to a NULL-terminated array of pointers to the 
- * keys in the tree in ascending order.
+ * keys in the tree in ascending order. The array must be freed by the
+ * caller. Use rbtree_export() to retrieve keys without allocating.
  * @param tree The rbtree for which the keys will be returned.
  * @return char** NULL on error, otherwise a pointer to a NULL-terminated
  * array of pointers to the keys in the tree.
  */
 extern char **rbtree_get_keys(rbtree_t *tree);
 
+/**
+ * @brief Returns the height of the tree, the number of nodes on the longest
+ * path from the root to a leaf. This visits every node.
+ * @param tree The rbtree to be measured.
+ * @return The height of the tree, 0 if it is empty.
+ */
+extern int rbtree_height(rbtree_t *tree);
+
 /** 
  * @brief Insert a new node with the given key into the tree. The cmp_func 
  * will be called to compare the given key with the keys of other nodes in 
  * order to determine where the node should be inserted. If a node with this 
  * key is already present in the tree, no new node is created and the pointer
- * to THAT node is returned.
+ * to THAT node is returned. If the key belongs to a tombstone, the tombstone
+ * is revived in place: del_func is called for it, then its key is replaced
+ * and its data cleared.
  * @param tree The rbtree into which the node is to be inserted.
  * @param key The key value to be inserted.
  * @return A pointer to the newly inserted node or the node with the matching
- * key if it already exists in the tree.
+ * key if it already exists in the tree. NULL if memory allocation failed,
+ * the tree is intrusive, or it already holds 2^32 - 1 nodes.
  */
 extern rbtree_node_t *rbtree_insert(rbtree_t *tree, void *key);
 
+/**
+ * @brief Sync and close the journal of a tree. The tree is no longer
+ * journaled afterwards. rbtree_free() does this itself.
+ * @param tree The journaled rbtree.
+ * @return 0 on success, -1 if there is no journal or a write failed.
+ */
+extern int rbtree_journal_close(rbtree_t *tree);
+
+/**
+ * @brief Recover a tree from its journal files and keep journaling it. The
+ * files are path with ".ckpt" and ".log" appended. The checkpoint and then
+ * the log are replayed into the tree, stopping at any record left torn by
+ * a crash. From then on rbtree_insert(), rbtree_set_data(), deletions and
+ * rbtree_expire_before() append records to the log. Records are collected
+ * in a buffer and reach the disk together on rbtree_journal_sync().
+ * Intrusive trees can't be journaled.
+ * @param tree The rbtree to recover into, normally empty.
+ * @param path The path the journal file names are built from.
+ * @param codec How keys and data are serialized.
+ * @return 0 on success, -1 on error.
+ */
+extern int rbtree_journal_open(rbtree_t *tree, const char *path, const rbtree_codec_t *codec);
+
+/**
+ * @brief Write buffered journal records to the log and sync it to disk.
+ * Changes made before this returns 0 survive a crash.
+ * @param tree The journaled rbtree.
+ * @return 0 on success, -1 if there is no journal or a write has failed
+ * since the journal was opened.
+ */
+extern int rbtree_journal_sync(rbtree_t *tree);
+
+/**
+ * @brief Return the node with the highest ordinal key in the tree. The node
+ * is cached in the tree structure, so this is O(1).
+ * @param tree The rbtree to be queried.
+ * @return A pointer to the node with the highest ordinal key or NULL if the
+ * tree is empty.
+ */
+extern rbtree_node_t *rbtree_last(rbtree_t *tree);
+
+/**
+ * @brief Key comparison function for trees whose keys are unsigned 64-bit
+ * integers stored directly in the key pointer. Passing this function as the
+ * cmp_func to rbtree_new() also lets rbtree_insert() and rbtree_lookup()
+ * compare keys inline instead of calling through the function pointer at
+ * each level of the tree.
+ * @param a The first key.
+ * @param b The second key.
+ * @return -1 if a < b, 0 if a == b, 1 if a > b.
+ */
+extern int rbtree_key_compare_uint64(void *a, void *b);
+
+/**
+ * @brief Link an application-owned node into a tree created with
+ * rbtree_new_intrusive(). The node's key field must be set before the call.
+ * No memory is allocated. If a node with an equal key is already in the
+ * tree, the given node is not linked and the existing node is returned. A
+ * tombstone with an equal key is instead replaced by the given node and
+ * passed to the del_func.
+ * @param tree The rbtree into which the node is to be linked.
+ * @param node The node to be linked.
+ * @return The given node if it was linked, otherwise the node already in
+ * the tree with an equal key. NULL if the tree isn't intrusive, since it
+ * would free the node.
+ */
+extern rbtree_node_t *rbtree_link(rbtree_t *tree, rbtree_node_t *node);
+
 /** 
  * @brief Look up a node with the given key. If the node with a matching key 
  * is found, a pointer to it is returned to the caller. The cmp_func will be
@@ -164,8 +610,8 @@ extern rbtree_node_t *rbtree_lookup(rbtree_t *tree, void *key);
 /** 
  * @brief Return the node with the key value with the highest ordinality 
  * rooted in the specified subtree. If the tree is empty, NULL is returned. If
- * subtree is NULL, the root of the red-black tree is used as the starting 
- * subtree.
+ * subtree is NULL, the cached rightmost node of the tree is returned without
+ * searching.
  * @param tree The rbtree containing the subtree to be searched.
  * @param subtree The subtree to be searched. If NULL, the entire tree is
  * searched.
@@ -177,8 +623,8 @@ extern rbtree_node_t *rbtree_maximum(rbtree_t *tree, rbtree_node_t *subtree);
 /** 
  * @brief Return the node with the key value with the lowest ordinality rooted
  * in the specified subtree. If the tree is empty, NULL is returned. If 
- * subtree is NULL, the root of the red-black tree is used as the starting 
- * subtree.
+ * subtree is NULL, the cached leftmost node of the tree is returned without
+ * searching.
  * @param tree The rbtree containing the subtree to be searched.
  * @param subtree The subtree to be searched. If NULL, the entire tree is
  * searched.
@@ -201,6 +647,244 @@ extern rbtree_node_t *rbtree_minimum(rbtree_t *tree, rbtree_node_t *subtree);
  */
 extern rbtree_t *rbtree_new(rbtree_key_compare_func_t cmp_func, rbtree_node_delete_func_t del_func);
 
+/**
+ * @brief Physically remove all tombstoned nodes from the tree, calling the
+ * del_func for each, then rebuild the remaining nodes into a balanced tree.
+ * This is done in O(n) time without allocating memory.
+ * @param tree The rbtree to be purged.
+ */
+extern void rbtree_purge(rbtree_t *tree);
+
+/**
+ * @brief Create a new red-black tree whose nodes are embedded in application
+ * structures. Nodes are added with rbtree_link() and removed with
+ * rbtree_unlink(), and the tree never allocates or frees them.
+ * rbtree_insert() always returns NULL for such a tree. Nodes removed by
+ * rbtree_delete_node(), rbtree_delete(), rbtree_free() or rbtree_purge() are
+ * handed to the del_func, which acts as the teardown callback. Use
+ * RBTREE_ENTRY() to get from a node to the structure that contains it.
+ * @param cmp_func The key comparison function.
+ * @param del_func The node teardown function.
+ * @return A pointer to the newly created rbtree_t structure or NULL if
+ * memory allocation failed.
+ */
+extern rbtree_t *rbtree_new_intrusive(rbtree_key_compare_func_t cmp_func, rbtree_node_delete_func_t del_func);
+
+/**
+ * @brief Create a new tree that is balanced by the given policy. rbtree_new()
+ * creates trees with the RBTREE_POLICY_RB policy. rbtree_expire_before() on
+ * a tree with another policy removes the expired nodes one at a time, in
+ * O(k log n) for k expired nodes rather than O(log n).
+ * @param cmp_func The key comparison function.
+ * @param del_func The node delete function.
+ * @param policy One of the RBTREE_POLICY_ balancing policies.
+ * @return A pointer to the newly created rbtree_t structure or NULL if
+ * memory allocation failed or the policy is unknown.
+ */
+extern rbtree_t *rbtree_new_with_policy(rbtree_key_compare_func_t cmp_func, rbtree_node_delete_func_t del_func, int policy);
+
+/**
+ * @brief Remove the node with the highest ordinal key from the tree and hand
+ * its key and data back to the caller. Ownership of the key and data passes
+ * to the caller, so the del_func is NOT called for the removed node.
+ * @param tree The rbtree to remove the node from.
+ * @param key If not NULL, receives the key of the removed node.
+ * @param data If not NULL, receives the data of the removed node.
+ * @return 0 if a node was removed, -1 if the tree is empty.
+ */
+extern int rbtree_pop_max(rbtree_t *tree, void **key, void **data);
+
+/**
+ * @brief Remove the node with the lowest ordinal key from the tree and hand
+ * its key and data back to the caller. Ownership of the key and data passes
+ * to the caller, so the del_func is NOT called for the removed node.
+ * @param tree The rbtree to remove the node from.
+ * @param key If not NULL, receives the key of the removed node.
+ * @param data If not NULL, receives the data of the removed node.
+ * @return 0 if a node was removed, -1 if the tree is empty.
+ */
+extern int rbtree_pop_min(rbtree_t *tree, void **key, void **data);
+
+/**
+ * @brief Destroy a detached node set on a new background thread. The thread
+ * calls rbtree_reclaim_step() until the set is gone. Callbacks run on that
+ * thread, so they must be safe to run there.
+ * @param detached The detached node set. It must not be used by the caller
+ * after this returns 0.
+ * @return 0 if the thread was started, -1 if it couldn't be, in which case
+ * the caller still owns the detached node set.
+ */
+extern int rbtree_reclaim_background(rbtree_detached_t *detached);
+
+/**
+ * @brief Destroy up to budget nodes of a detached node set, calling the
+ * callbacks for each. Once the last node is destroyed, the detached node set
+ * itself is freed.
+ * @param detached The detached node set.
+ * @param budget The maximum number of nodes to destroy.
+ * @return The number of nodes still to be destroyed. When this is 0, the
+ * detached node set has been freed and must not be used again.
+ */
+extern unsigned long int rbtree_reclaim_step(rbtree_detached_t *detached, unsigned long int budget);
+
+/**
+ * @brief Read lock and return the replica local to the calling thread, for
+ * lookups and traversals that need more than rbtree_replicated_lookup().
+ * The tree must not be modified and must be handed back with
+ * rbtree_replicated_release().
+ * @param rt The replicated tree.
+ * @return The local replica, or NULL if rt is NULL.
+ */
+extern rbtree_t *rbtree_replicated_acquire(rbtree_replicated_t *rt);
+
+/**
+ * @brief Apply all queued writes to every replica. Each replica is write
+ * locked only while the batch is applied to it.
+ * @param rt The replicated tree.
+ * @return 0 on success, -1 if an insert failed on some replica. A failed
+ * insert is dropped from every replica, so they stay identical.
+ */
+extern int rbtree_replicated_commit(rbtree_replicated_t *rt);
+
+/**
+ * @brief Queue the deletion of the node with the given key. The key stays
+ * visible to readers until the next commit.
+ * @param rt The replicated tree.
+ * @param key The key to be deleted.
+ * @return 0 on success, -1 if the write couldn't be queued.
+ */
+extern int rbtree_replicated_delete(rbtree_replicated_t *rt, void *key);
+
+/**
+ * @brief Free a replicated tree and all of its replicas. Queued writes are
+ * discarded. The del_func is called once per node.
+ * @param rt The replicated tree.
+ */
+extern void rbtree_replicated_free(rbtree_replicated_t *rt);
+
+/**
+ * @brief Queue the insertion of a key and its data. If the key is already
+ * present, its data is replaced. The key and data are shared by all
+ * replicas and must stay valid until the node is deleted. When the key is
+ * already present, the del_func is called once, after every replica has
+ * been updated, with a node holding this copy of the key and the replaced
+ * data. Either is NULL if it is the same pointer the tree keeps.
+ * @param rt The replicated tree.
+ * @param key The key to be inserted.
+ * @param data The data to be stored with the key.
+ * @return 0 on success, -1 if the write couldn't be queued.
+ */
+extern int rbtree_replicated_insert(rbtree_replicated_t *rt, void *key, void *data);
+
+/**
+ * @brief Look up a key in the replica local to the calling thread.
+ * @param rt The replicated tree.
+ * @param key The key to look for.
+ * @param data Set to the key's data if it is found and data isn't NULL.
+ * @return 0 if the key was found, -1 if not.
+ */
+extern int rbtree_replicated_lookup(rbtree_replicated_t *rt, void *key, void **data);
+
+/**
+ * @brief Create a tree replicated once per NUMA node. The nodes of each
+ * replica are allocated on its own NUMA node with rbtree_set_numa_node().
+ * A replica whose node can't be bound, e.g. one listed by the topology that
+ * the system doesn't have, allocates its nodes with malloc() instead.
+ * Only one replica calls del_func, so keys and data are released once.
+ * @param cmp_func The key comparison function.
+ * @param del_func The node delete function, or NULL.
+ * @param topology The NUMA layout, or NULL to read it from the system.
+ * @return The new replicated tree, or NULL if memory couldn't be allocated.
+ */
+extern rbtree_replicated_t *rbtree_replicated_new(rbtree_key_compare_func_t cmp_func, rbtree_node_delete_func_t del_func, const rbtree_topology_t *topology);
+
+/**
+ * @brief Release a replica returned by rbtree_replicated_acquire().
+ * @param rt The replicated tree.
+ * @param tree The replica to release.
+ */
+extern void rbtree_replicated_release(rbtree_replicated_t *rt, rbtree_t *tree);
+
+/**
+ * @brief Give a tree a change feed, so that rbtree_changes_since() can
+ * report what has changed. Changes stamp nodes with a new tree version and
+ * removals are recorded in a ring of capacity entries, overwriting the
+ * oldest when it is full. Changes made before this call, or overwritten,
+ * can't be reported. Assign data with rbtree_set_data() so that the change
+ * is seen. Nodes of a tree with a change feed are allocated with room for
+ * their versions after the node, so a feed can only be added to a tree
+ * that is empty or already has one, and never to an intrusive tree.
+ * @param tree The rbtree.
+ * @param capacity Number of removals kept, or 0 to drop the change feed.
+ * @param key_dup Copies keys of removed nodes, or NULL to keep the key
+ * pointers, which must then remain valid.
+ * @param key_free Frees keys returned by key_dup, or NULL.
+ * @return 0 on success, -1 if memory allocation failed or the tree can't
+ * have a change feed.
+ */
+extern int rbtree_set_change_feed(rbtree_t *tree, unsigned long int capacity, rbtree_key_dup_func_t key_dup, rbtree_key_free_func_t key_free);
+
+/**
+ * @brief Set the data of a node. This is the same as assigning node->data,
+ * except that the change is journaled if the tree has a journal and reported
+ * by rbtree_changes_since() if it has a change feed.
+ * @param tree The rbtree containing the node.
+ * @param node The node to be updated.
+ * @param data The new data.
+ */
+extern void rbtree_set_data(rbtree_t *tree, rbtree_node_t *node, void *data);
+
+/**
+ * @brief Give the tree a cache of looked up nodes, so repeated lookups of
+ * the same keys are answered with one key comparison instead of a search.
+ * Keys hashing to the same set of slots share them, the least recently used
+ * node making way for a new one. A node leaves the cache when it is
+ * deleted, and the whole cache is emptied by rbtree_expire_before() and
+ * rbtree_detach_all(). Lookups update the cache, so a tree with a cache must
+ * not be searched by several threads at once. The hit and miss counters are
+ * reset.
+ * @param tree The rbtree to be configured.
+ * @param slots The number of cache slots, rounded up to a power of two of
+ * at least two. Zero removes the cache.
+ * @param hash Hashes keys. If NULL, the key pointer itself is hashed, which
+ * is only allowed for trees using rbtree_key_compare_uint64, whose keys are
+ * the pointer values.
+ * @return 0 on success, -1 if memory couldn't be allocated or hash is NULL
+ * and the tree doesn't use rbtree_key_compare_uint64.
+ */
+extern int rbtree_set_lookup_cache(rbtree_t *tree, unsigned long int slots, rbtree_key_hash_func_t hash);
+
+/**
+ * @brief Enable or disable lazy deletion. While enabled, rbtree_delete_node()
+ * only marks a node as a tombstone. rbtree_lookup() and the traversals skip
+ * tombstones. Tombstones are removed in a batch by rbtree_purge(). That
+ * happens automatically once they make up purge_ratio percent of the nodes
+ * linked into the tree. Tombstones at either end of the tree are removed
+ * right away, so rbtree_first() and rbtree_last() stay O(1) and, like
+ * rbtree_minimum() and rbtree_maximum() without a subtree, never return
+ * one.
+ * @param tree The rbtree to be configured.
+ * @param purge_ratio Tombstone percentage that triggers a purge, 1 to 100.
+ * Zero disables lazy deletion and purges any remaining tombstones.
+ */
+extern void rbtree_set_lazy_delete(rbtree_t *tree, unsigned int purge_ratio);
+
+/**
+ * @brief Allocate the tree's nodes on the given NUMA node from now on. Nodes
+ * are carved out of mmap()ed arena blocks bound to the node with mbind(),
+ * the same blocks rbtree_compact() uses. The memory of deleted nodes is
+ * returned when their whole block empties, so this suits trees that are
+ * mostly read. Nodes already in the tree stay where they are until the next
+ * rbtree_compact(). If a later block can't be bound, the insert that needed
+ * it returns NULL.
+ * @param tree The rbtree to be configured.
+ * @param numa_node The NUMA node, or -1 to go back to malloc().
+ * @return 0 on success, -1 if the tree is intrusive or a block couldn't be
+ * bound to the node, for example because it doesn't exist. The tree goes
+ * back to malloc() in that case.
+ */
+extern int rbtree_set_numa_node(rbtree_t *tree, int numa_node);
+
 /** 
  * @brief Traverse a subtree in order from lowest ordinal key to highest 
  * ordinal key. If the subtree is NULL, then the traversal is across the 
@@ -235,4 +919,14 @@ extern int rbtree_traverse_ascending(rbtree_t *tree, rbtree_node_t *subtree, rbt
  */
 extern int rbtree_traverse_descending(rbtree_t *tree, rbtree_node_t *subtree, rbtree_traverse_func_t cb);
 
+/**
+ * @brief Remove a node from the tree without calling the del_func or freeing
+ * it, returning it to the application. This is mainly for trees created
+ * with rbtree_new_intrusive(). The node's parent, left and right fields are
+ * set to NULL.
+ * @param tree The rbtree containing the node.
+ * @param node The node to be unlinked.
+ */
+extern void rbtree_unlink(rbtree_t *tree, rbtree_node_t *node);
+
 #endif // _RBTREE_H
\ No newline at end of file
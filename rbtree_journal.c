@@ -0,0 +1,630 @@
+/**
+ * @file rbtree_journal.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Write-ahead journal and incremental checkpoints for red-black trees
+ * @version 0.1
+ * @date 2024-01-24
+ *
+ * @copyright Copyright (c) 2024, Warren Mann
+ *
+ * A journaled tree is kept in two files. The log holds a record of every
+ * change since the last checkpoint. The checkpoint holds the records needed
+ * to rebuild the tree as it was at the last checkpoint. An incremental
+ * checkpoint appends only the net change of each key modified since the
+ * previous checkpoint, taken from a side tree of dirty keys, and then
+ * empties the log. Recovery replays the checkpoint and then the log.
+ *
+ * Records are written in native byte order:
+ *
+ *     uint32_t checksum;  FNV-1a of everything after it
+ *     uint8_t op;         RBTREE_JOURNAL_PUT, _DELETE, _EXPIRE or _CLEAR
+ *     uint32_t key_len;
+ *     uint32_t data_len;  RECORD_NULL if the data is NULL
+ *     key bytes, then data bytes
+ *
+ * Replay stops at the first short or damaged record, which is where a crash
+ * during a write leaves the file, and the file is truncated there.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rbtree.h"
+#include "rbtree_journal.h"
+
+#define RECORD_HEADER               13
+#define RECORD_NULL                 0xffffffff
+
+struct rbtree_journal_t {
+    /// @brief The tree being journaled.
+    rbtree_t *tree;
+    /// @brief How keys and data are serialized.
+    rbtree_codec_t codec;
+    char *log_path;
+    char *ckpt_path;
+    int log_fd;
+    /// @brief Records not yet written to the log.
+    unsigned char *buffer;
+    size_t buffered;
+    /// @brief Scratch space for encoding one record.
+    unsigned char *record;
+    size_t record_size;
+    /// @brief The latest record for each key changed since the last
+    /// checkpoint, keyed by the serialized key.
+    rbtree_t *dirty;
+    /// @brief Non-zero if the next checkpoint must rewrite the whole tree,
+    /// because of a bulk removal or an earlier failure.
+    int full;
+    /// @brief Size of the checkpoint file, and its size after the last full
+    /// checkpoint.
+    off_t ckpt_size;
+    off_t ckpt_base;
+    /// @brief Set once a write fails. Reported by rbtree_journal_sync().
+    int error;
+};
+
+static void apply_record(rbtree_t *tree, const rbtree_codec_t *codec, int op, unsigned char *key, uint32_t key_len, unsigned char *data, uint32_t data_len);
+static uint32_t checksum(const unsigned char *buf, size_t len);
+static int dirty_compare(void *a, void *b);
+static void dirty_free(rbtree_node_t *node);
+static size_t encode_record(rbtree_journal_t *j, int op, void *key, void *data);
+static size_t encode_value(rbtree_journal_t *j, size_t (*encode)(void *, void *, size_t), void *value, size_t offset);
+static void free_journal(rbtree_journal_t *j);
+static int flush_buffer(rbtree_journal_t *j, int fd);
+static int grow_record(rbtree_journal_t *j, size_t size);
+static void release(rbtree_t *tree, void *key, void *data);
+static int replay(rbtree_journal_t *j, const char *path, int track, off_t *end);
+static int stage(rbtree_journal_t *j, int fd, const unsigned char *rec, size_t len);
+static int sync_dir(const char *path);
+static void track_dirty(rbtree_journal_t *j, int op, const unsigned char *rec, size_t len);
+static int write_all(int fd, const unsigned char *buf, size_t len);
+static int write_full(rbtree_journal_t *j);
+static int write_incremental(rbtree_journal_t *j);
+
+int rbtree_checkpoint(rbtree_t *tree) {
+    rbtree_journal_t *j;
+    int rc;
+    if (tree == NULL || tree->journal == NULL) {
+        return -1;
+    }
+    j = tree->journal;
+    if (flush_buffer(j, j->log_fd) != 0) {
+        return -1;
+    }
+    // Incremental checkpoints only ever grow the file, so once they add up
+    // to more than the last full one it is rewritten.
+    if (j->ckpt_size > 2 * j->ckpt_base + RBTREE_JOURNAL_BUFFER_SIZE) {
+        j->full = 1;
+    }
+    rc = j->full ? write_full(j) : write_incremental(j);
+    if (rc != 0) {
+        j->full = 1;
+        return -1;
+    }
+    if (ftruncate(j->log_fd, 0) != 0 || fsync(j->log_fd) != 0) {
+        j->error = 1;
+        return -1;
+    }
+    rbtree_delete(j->dirty, NULL);
+    j->full = 0;
+    return 0;
+}
+
+int rbtree_journal_close(rbtree_t *tree) {
+    int rc;
+    if (tree == NULL || tree->journal == NULL) {
+        return -1;
+    }
+    rc = rbtree_journal_sync(tree);
+    free_journal(tree->journal);
+    tree->journal = NULL;
+    return rc;
+}
+
+void rbtree_journal_log(rbtree_journal_t *j, int op, void *key, void *data) {
+    size_t len = encode_record(j, op, key, data);
+    if (len == 0) {
+        j->error = 1;
+        return;
+    }
+    if (stage(j, j->log_fd, j->record, len) != 0) {
+        j->error = 1;
+    }
+    track_dirty(j, op, j->record, len);
+}
+
+int rbtree_journal_open(rbtree_t *tree, const char *path, const rbtree_codec_t *codec) {
+    rbtree_journal_t *j;
+    size_t len;
+    off_t end;
+    int nonempty;
+    if (tree == NULL || path == NULL || codec == NULL || codec->encode_key == NULL || codec->decode_key == NULL || tree->intrusive || tree->journal != NULL) {
+        return -1;
+    }
+    j = calloc(1, sizeof(rbtree_journal_t));
+    if (j == NULL) {
+        return -1;
+    }
+    j->tree = tree;
+    j->codec = *codec;
+    j->log_fd = -1;
+    len = strlen(path);
+    j->log_path = malloc(len + sizeof(".log"));
+    j->ckpt_path = malloc(len + sizeof(".ckpt"));
+    j->buffer = malloc(RBTREE_JOURNAL_BUFFER_SIZE);
+    j->dirty = rbtree_new(dirty_compare, dirty_free);
+    if (j->log_path == NULL || j->ckpt_path == NULL || j->buffer == NULL || j->dirty == NULL || grow_record(j, 256) != 0) {
+        free_journal(j);
+        return -1;
+    }
+    sprintf(j->log_path, "%s.log", path);
+    sprintf(j->ckpt_path, "%s.ckpt", path);
+    nonempty = tree->root != &tree->nil_node;
+    if (replay(j, j->ckpt_path, 0, &end) != 0) {
+        free_journal(j);
+        return -1;
+    }
+    if (end > 0 && truncate(j->ckpt_path, end) != 0) {
+        free_journal(j);
+        return -1;
+    }
+    j->ckpt_size = end;
+    j->ckpt_base = end;
+    // Nodes already in the tree were never logged, so the first checkpoint
+    // has to include them.
+    j->full = nonempty || end == 0;
+    if (replay(j, j->log_path, 1, &end) != 0) {
+        free_journal(j);
+        return -1;
+    }
+    j->log_fd = open(j->log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (j->log_fd < 0 || ftruncate(j->log_fd, end) != 0) {
+        free_journal(j);
+        return -1;
+    }
+    tree->journal = j;
+    return 0;
+}
+
+int rbtree_journal_sync(rbtree_t *tree) {
+    rbtree_journal_t *j;
+    if (tree == NULL || tree->journal == NULL) {
+        return -1;
+    }
+    j = tree->journal;
+    if (flush_buffer(j, j->log_fd) != 0 || fsync(j->log_fd) != 0) {
+        j->error = 1;
+    }
+    return j->error ? -1 : 0;
+}
+
+/**
+ * Apply one replayed record to the tree. The key and data are decoded into
+ * new objects, so any that don't end up in the tree are handed to the
+ * del_func in a temporary node.
+ */
+static void apply_record(rbtree_t *tree, const rbtree_codec_t *codec, int op, unsigned char *key, uint32_t key_len, unsigned char *data, uint32_t data_len) {
+    rbtree_detached_t *detached = NULL;
+    rbtree_node_t *node;
+    void *k = NULL;
+    void *d = NULL;
+    if (op != RBTREE_JOURNAL_CLEAR) {
+        k = codec->decode_key(key, key_len);
+    }
+    if (op == RBTREE_JOURNAL_PUT && data_len != RECORD_NULL && codec->decode_data != NULL) {
+        d = codec->decode_data(data, data_len);
+    }
+    switch (op) {
+    case RBTREE_JOURNAL_PUT:
+        node = rbtree_lookup(tree, k);
+        if (node != NULL) {
+            void *old = node->data;
+            node->data = d;
+            release(tree, k, old);
+        } else {
+            node = rbtree_insert(tree, k);
+            if (node == NULL) {
+                release(tree, k, d);
+            } else {
+                node->data = d;
+            }
+        }
+        return;
+    case RBTREE_JOURNAL_DELETE:
+        node = rbtree_lookup(tree, k);
+        if (node != NULL) {
+            rbtree_delete_node(tree, node);
+        }
+        break;
+    case RBTREE_JOURNAL_EXPIRE:
+        detached = rbtree_expire_before(tree, k, NULL);
+        break;
+    case RBTREE_JOURNAL_CLEAR:
+        detached = rbtree_detach_all(tree);
+        break;
+    }
+    while (rbtree_reclaim_step(detached, ULONG_MAX) > 0) {
+    }
+    if (op != RBTREE_JOURNAL_CLEAR) {
+        release(tree, k, NULL);
+    }
+}
+
+static uint32_t checksum(const unsigned char *buf, size_t len) {
+    uint32_t h = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= buf[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Dirty tree keys are whole records. They are ordered by the serialized key
+ * alone, so the latest record for a key replaces the one before it.
+ */
+static int dirty_compare(void *a, void *b) {
+    const unsigned char *ra = a;
+    const unsigned char *rb = b;
+    uint32_t la;
+    uint32_t lb;
+    int i;
+    memcpy(&la, ra + 5, sizeof(uint32_t));
+    memcpy(&lb, rb + 5, sizeof(uint32_t));
+    i = memcmp(ra + RECORD_HEADER, rb + RECORD_HEADER, la < lb ? la : lb);
+    if (i != 0) {
+        return i;
+    }
+    return la < lb ? -1 : la > lb;
+}
+
+static void dirty_free(rbtree_node_t *node) {
+    free(node->key);
+}
+
+/**
+ * Encode a record into j->record. Returns its length, or 0 if memory ran out
+ * or a key or data is too large to record.
+ */
+static size_t encode_record(rbtree_journal_t *j, int op, void *key, void *data) {
+    uint32_t key_len = 0;
+    uint32_t data_len = RECORD_NULL;
+    size_t len = RECORD_HEADER;
+    size_t n;
+    uint32_t sum;
+    if (op != RBTREE_JOURNAL_CLEAR) {
+        n = encode_value(j, j->codec.encode_key, key, len);
+        if (n >= RECORD_NULL) {
+            return 0;
+        }
+        key_len = n;
+        len += n;
+    }
+    if (op == RBTREE_JOURNAL_PUT && data != NULL && j->codec.encode_data != NULL) {
+        n = encode_value(j, j->codec.encode_data, data, len);
+        if (n >= RECORD_NULL) {
+            return 0;
+        }
+        data_len = n;
+        len += n;
+    }
+    j->record[4] = op;
+    memcpy(j->record + 5, &key_len, sizeof(uint32_t));
+    memcpy(j->record + 9, &data_len, sizeof(uint32_t));
+    sum = checksum(j->record + 4, len - 4);
+    memcpy(j->record, &sum, sizeof(uint32_t));
+    return len;
+}
+
+/**
+ * Serialize a key or data into j->record at offset, growing it if the codec
+ * says it needs more room. Returns the serialized length, or RECORD_NULL if
+ * memory ran out.
+ */
+static size_t encode_value(rbtree_journal_t *j, size_t (*encode)(void *, void *, size_t), void *value, size_t offset) {
+    size_t n = encode(value, j->record + offset, j->record_size - offset);
+    if (n > j->record_size - offset) {
+        if (n >= RECORD_NULL || grow_record(j, offset + n) != 0) {
+            return RECORD_NULL;
+        }
+        n = encode(value, j->record + offset, j->record_size - offset);
+    }
+    return n;
+}
+
+static void free_journal(rbtree_journal_t *j) {
+    if (j->log_fd >= 0) {
+        close(j->log_fd);
+    }
+    rbtree_free(j->dirty);
+    free(j->log_path);
+    free(j->ckpt_path);
+    free(j->buffer);
+    free(j->record);
+    free(j);
+}
+
+static int flush_buffer(rbtree_journal_t *j, int fd) {
+    int rc = 0;
+    if (j->buffered > 0) {
+        rc = write_all(fd, j->buffer, j->buffered);
+        j->buffered = 0;
+    }
+    return rc;
+}
+
+static int grow_record(rbtree_journal_t *j, size_t size) {
+    unsigned char *record;
+    if (size <= j->record_size) {
+        return 0;
+    }
+    if (size < j->record_size * 2) {
+        size = j->record_size * 2;
+    }
+    record = realloc(j->record, size);
+    if (record == NULL) {
+        return -1;
+    }
+    j->record = record;
+    j->record_size = size;
+    return 0;
+}
+
+/**
+ * Pass a key and data that are not in the tree to its del_func.
+ */
+static void release(rbtree_t *tree, void *key, void *data) {
+    rbtree_node_t node;
+    if (tree->del_func != NULL) {
+        node.parent = node.left = node.right = NULL;
+        node.flags = 0;
+        node.key = key;
+        node.data = data;
+        tree->del_func(&node);
+    }
+}
+
+/**
+ * Apply the records in a file to the tree, setting end to the length of the
+ * valid part of the file. If track is set, the records are also added to
+ * the dirty tree. A missing file is treated as an empty one. The header
+ * isn't covered by the checksum until the whole record has been read, so a
+ * record that claims to run past the end of the file is treated as torn
+ * before any memory is allocated for it.
+ */
+static int replay(rbtree_journal_t *j, const char *path, int track, off_t *end) {
+    FILE *f = fopen(path, "rb");
+    struct stat st;
+    *end = 0;
+    if (f == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (fstat(fileno(f), &st) != 0) {
+        fclose(f);
+        return -1;
+    }
+    for (;;) {
+        uint32_t sum;
+        uint32_t key_len;
+        uint32_t data_len;
+        size_t len;
+        if (fread(j->record, 1, RECORD_HEADER, f) != RECORD_HEADER) {
+            break;
+        }
+        memcpy(&sum, j->record, sizeof(uint32_t));
+        memcpy(&key_len, j->record + 5, sizeof(uint32_t));
+        memcpy(&data_len, j->record + 9, sizeof(uint32_t));
+        len = RECORD_HEADER + (size_t)key_len + (data_len != RECORD_NULL ? data_len : 0);
+        if (len > (size_t)(st.st_size - *end)) {
+            break;
+        }
+        if (grow_record(j, len) != 0 || fread(j->record + RECORD_HEADER, 1, len - RECORD_HEADER, f) != len - RECORD_HEADER || checksum(j->record + 4, len - 4) != sum) {
+            break;
+        }
+        apply_record(j->tree, &j->codec, j->record[4], j->record + RECORD_HEADER, key_len, j->record + RECORD_HEADER + key_len, data_len);
+        if (track) {
+            track_dirty(j, j->record[4], j->record, len);
+        }
+        *end += len;
+    }
+    fclose(f);
+    return 0;
+}
+
+/**
+ * Append a record to the write buffer, writing the buffer to fd when it
+ * fills. Records larger than the buffer are written directly.
+ */
+static int stage(rbtree_journal_t *j, int fd, const unsigned char *rec, size_t len) {
+    if (j->buffered + len > RBTREE_JOURNAL_BUFFER_SIZE && flush_buffer(j, fd) != 0) {
+        return -1;
+    }
+    if (len > RBTREE_JOURNAL_BUFFER_SIZE) {
+        return write_all(fd, rec, len);
+    }
+    memcpy(j->buffer + j->buffered, rec, len);
+    j->buffered += len;
+    return 0;
+}
+
+/**
+ * Sync the directory containing path, so that a rename into it is durable.
+ */
+static int sync_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir;
+    int fd;
+    int rc;
+    if (slash == NULL) {
+        dir = strdup(".");
+    } else {
+        dir = strndup(path, slash == path ? 1 : (size_t)(slash - path));
+    }
+    if (dir == NULL) {
+        return -1;
+    }
+    fd = open(dir, O_RDONLY);
+    free(dir);
+    if (fd < 0) {
+        return -1;
+    }
+    rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+/**
+ * Remember the latest record for a key until the next checkpoint. Bulk
+ * removals can't be reduced to per-key records without walking the tree,
+ * so they make the next checkpoint a full one instead.
+ */
+static void track_dirty(rbtree_journal_t *j, int op, const unsigned char *rec, size_t len) {
+    rbtree_node_t *node;
+    unsigned char *copy;
+    if (j->full) {
+        return;
+    }
+    if (op == RBTREE_JOURNAL_EXPIRE || op == RBTREE_JOURNAL_CLEAR) {
+        j->full = 1;
+        rbtree_delete(j->dirty, NULL);
+        return;
+    }
+    copy = malloc(len);
+    if (copy == NULL) {
+        j->full = 1;
+        rbtree_delete(j->dirty, NULL);
+        return;
+    }
+    memcpy(copy, rec, len);
+    node = rbtree_insert(j->dirty, copy);
+    if (node == NULL) {
+        free(copy);
+        j->full = 1;
+        rbtree_delete(j->dirty, NULL);
+    } else if (node->key != copy) {
+        free(node->key);
+        node->key = copy;
+    }
+}
+
+static int write_all(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Write every key in the tree to a new checkpoint file, then rename it over
+ * the old one.
+ */
+static int write_full(rbtree_journal_t *j) {
+    rbtree_export_token_t token = { NULL, RBTREE_EXPORT_BEGIN };
+    void *keys[256];
+    void *data[256];
+    unsigned long int n;
+    unsigned long int i;
+    off_t size = 0;
+    char *tmp_path;
+    int rc = 0;
+    int fd;
+    tmp_path = malloc(strlen(j->ckpt_path) + sizeof(".tmp"));
+    if (tmp_path == NULL) {
+        return -1;
+    }
+    sprintf(tmp_path, "%s.tmp", j->ckpt_path);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(tmp_path);
+        return -1;
+    }
+    while (rc == 0 && (n = rbtree_export(j->tree, &token, keys, data, 256)) > 0) {
+        for (i = 0; i < n && rc == 0; i++) {
+            size_t len = encode_record(j, RBTREE_JOURNAL_PUT, keys[i], data[i]);
+            rc = len != 0 ? stage(j, fd, j->record, len) : -1;
+            size += len;
+        }
+    }
+    if (rc == 0) {
+        rc = flush_buffer(j, fd);
+    } else {
+        j->buffered = 0;
+    }
+    if (rc == 0) {
+        rc = fsync(fd);
+    }
+    close(fd);
+    if (rc == 0) {
+        rc = rename(tmp_path, j->ckpt_path);
+    }
+    if (rc == 0) {
+        rc = sync_dir(j->ckpt_path);
+        j->ckpt_size = size;
+        j->ckpt_base = size;
+    } else {
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    return rc;
+}
+
+/**
+ * Append the latest record of each dirty key to the checkpoint file.
+ */
+static int write_incremental(rbtree_journal_t *j) {
+    rbtree_export_token_t token = { NULL, RBTREE_EXPORT_BEGIN };
+    void *records[256];
+    unsigned long int n;
+    unsigned long int i;
+    off_t size = 0;
+    int rc = 0;
+    int fd;
+    if (j->dirty->node_count == 0) {
+        return 0;
+    }
+    fd = open(j->ckpt_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    while (rc == 0 && (n = rbtree_export(j->dirty, &token, records, NULL, 256)) > 0) {
+        for (i = 0; i < n && rc == 0; i++) {
+            const unsigned char *rec = records[i];
+            uint32_t key_len;
+            uint32_t data_len;
+            size_t len;
+            memcpy(&key_len, rec + 5, sizeof(uint32_t));
+            memcpy(&data_len, rec + 9, sizeof(uint32_t));
+            len = RECORD_HEADER + (size_t)key_len + (data_len != RECORD_NULL ? data_len : 0);
+            rc = stage(j, fd, rec, len);
+            size += len;
+        }
+    }
+    if (rc == 0) {
+        rc = flush_buffer(j, fd);
+    } else {
+        j->buffered = 0;
+    }
+    if (rc == 0) {
+        rc = fsync(fd);
+    }
+    close(fd);
+    if (rc == 0) {
+        j->ckpt_size += size;
+    }
+    return rc;
+}
@@ -0,0 +1,33 @@
+/**
+ * @file rbtree_journal.h
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief Internal interface between the tree and its write-ahead journal.
+ * This isn't part of the public API.
+ * @version 0.1
+ * @date 2024-01-24
+ *
+ * @copyright Copyright (c) 2024, Warren Mann
+ */
+
+#ifndef _RBTREE_JOURNAL_H
+#define _RBTREE_JOURNAL_H
+
+#include "rbtree.h"
+
+#define RBTREE_JOURNAL_PUT          1
+#define RBTREE_JOURNAL_DELETE       2
+#define RBTREE_JOURNAL_EXPIRE       3
+#define RBTREE_JOURNAL_CLEAR        4
+
+/**
+ * @brief Append a record of a change to the tree to the journal. PUT records
+ * a key and its data, DELETE and EXPIRE a key, and CLEAR nothing. Errors are
+ * remembered and reported by the next rbtree_journal_sync().
+ * @param journal The journal of the tree that changed.
+ * @param op One of the RBTREE_JOURNAL_ operations.
+ * @param key The key concerned, if any.
+ * @param data The key's data, for PUT records.
+ */
+extern void rbtree_journal_log(rbtree_journal_t *journal, int op, void *key, void *data);
+
+#endif // _RBTREE_JOURNAL_H
@@ -0,0 +1,329 @@
+/**
+ * @file rbtree_replica.c
+ * @author Warren Mann (warren@nonvol.io)
+ * @brief NUMA replicated red-black trees
+ * @version 0.1
+ * @date 2024-01-24
+ *
+ * @copyright Copyright (c) 2024, Warren Mann
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "rbtree.h"
+
+#define RBTREE_REPLICA_INSERT       0
+#define RBTREE_REPLICA_DELETE       1
+#define RBTREE_REPLICA_DROPPED      2
+
+/**
+ * One copy of the tree. Replicas are cache line aligned so that readers on
+ * different NUMA nodes don't share the line holding a lock.
+ */
+typedef struct replica_t {
+    rbtree_t *tree;
+    pthread_rwlock_t lock;
+} __attribute__((aligned(64))) replica_t;
+
+typedef struct replica_write_t {
+    int op;
+    void *key;
+    void *data;
+} replica_write_t;
+
+struct rbtree_replicated_t {
+    /// @brief One replica per NUMA node.
+    replica_t *replicas;
+    /// @brief Number of replicas.
+    int replica_count;
+    /// @brief Returns the NUMA node of the calling thread.
+    int (*current_node)(void);
+    /// @brief Serializes writers.
+    pthread_mutex_t write_lock;
+    /// @brief Writes not yet applied to the replicas.
+    replica_write_t *pending;
+    unsigned long int pending_count;
+    unsigned long int pending_capacity;
+};
+
+static int apply_pending(rbtree_replicated_t *rt);
+static void drop_insert(rbtree_replicated_t *rt, int failed, unsigned long int j);
+static int getcpu_node(void);
+static replica_t *local_replica(rbtree_replicated_t *rt);
+static int possible_nodes(void);
+static int queue_write(rbtree_replicated_t *rt, int op, void *key, void *data);
+static void release_replaced(rbtree_t *tree, void *key, void *data);
+
+rbtree_t *rbtree_replicated_acquire(rbtree_replicated_t *rt) {
+    replica_t *replica;
+    if (rt == NULL) {
+        return NULL;
+    }
+    replica = local_replica(rt);
+    pthread_rwlock_rdlock(&replica->lock);
+    return replica->tree;
+}
+
+int rbtree_replicated_commit(rbtree_replicated_t *rt) {
+    int rc;
+    if (rt == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&rt->write_lock);
+    rc = apply_pending(rt);
+    pthread_mutex_unlock(&rt->write_lock);
+    return rc;
+}
+
+int rbtree_replicated_delete(rbtree_replicated_t *rt, void *key) {
+    return queue_write(rt, RBTREE_REPLICA_DELETE, key, NULL);
+}
+
+void rbtree_replicated_free(rbtree_replicated_t *rt) {
+    int i;
+    if (rt == NULL) {
+        return;
+    }
+    for (i = 0; i < rt->replica_count; i++) {
+        rbtree_free(rt->replicas[i].tree);
+        pthread_rwlock_destroy(&rt->replicas[i].lock);
+    }
+    pthread_mutex_destroy(&rt->write_lock);
+    free(rt->replicas);
+    free(rt->pending);
+    free(rt);
+}
+
+int rbtree_replicated_insert(rbtree_replicated_t *rt, void *key, void *data) {
+    return queue_write(rt, RBTREE_REPLICA_INSERT, key, data);
+}
+
+int rbtree_replicated_lookup(rbtree_replicated_t *rt, void *key, void **data) {
+    rbtree_node_t *node;
+    replica_t *replica;
+    if (rt == NULL) {
+        return -1;
+    }
+    replica = local_replica(rt);
+    pthread_rwlock_rdlock(&replica->lock);
+    node = rbtree_lookup(replica->tree, key);
+    if (node != NULL && data != NULL) {
+        *data = node->data;
+    }
+    pthread_rwlock_unlock(&replica->lock);
+    return node != NULL ? 0 : -1;
+}
+
+rbtree_replicated_t *rbtree_replicated_new(rbtree_key_compare_func_t cmp_func, rbtree_node_delete_func_t del_func, const rbtree_topology_t *topology) {
+    rbtree_replicated_t *rt = calloc(1, sizeof(rbtree_replicated_t));
+    int count = topology != NULL ? topology->node_count : possible_nodes();
+    if (rt == NULL) {
+        return NULL;
+    }
+    if (count < 1) {
+        count = 1;
+    }
+    rt->replicas = aligned_alloc(sizeof(replica_t), count * sizeof(replica_t));
+    if (rt->replicas == NULL) {
+        free(rt);
+        return NULL;
+    }
+    rt->current_node = topology != NULL && topology->current_node != NULL ? topology->current_node : getcpu_node;
+    pthread_mutex_init(&rt->write_lock, NULL);
+    for (rt->replica_count = 0; rt->replica_count < count; rt->replica_count++) {
+        replica_t *replica = &rt->replicas[rt->replica_count];
+        // Keys and data are shared by the replicas, so only the first one
+        // gets to delete them.
+        replica->tree = rbtree_new(cmp_func, rt->replica_count == 0 ? del_func : NULL);
+        if (replica->tree == NULL) {
+            rbtree_replicated_free(rt);
+            return NULL;
+        }
+        pthread_rwlock_init(&replica->lock, NULL);
+        // A node that can't be bound leaves the replica on malloc(), which
+        // is still correct, just not local.
+        rbtree_set_numa_node(replica->tree, rt->replica_count);
+    }
+    return rt;
+}
+
+void rbtree_replicated_release(rbtree_replicated_t *rt, rbtree_t *tree) {
+    int i;
+    if (rt == NULL) {
+        return;
+    }
+    for (i = 0; i < rt->replica_count; i++) {
+        if (rt->replicas[i].tree == tree) {
+            pthread_rwlock_unlock(&rt->replicas[i].lock);
+            return;
+        }
+    }
+}
+
+/**
+ * Apply the queued writes to every replica in turn. Each replica is locked
+ * only while the batch is applied to it, so readers on other nodes carry on.
+ * Replica 0 owns the keys and goes last, so a deleted key is not released
+ * while another replica still refers to it. For the same reason, an insert
+ * of a key already present releases the queued copy of the key and the
+ * replaced data once replica 0 is updated. An insert that fails on one
+ * replica is dropped from all of them, so they stay identical. Called with
+ * write_lock held.
+ */
+static int apply_pending(rbtree_replicated_t *rt) {
+    unsigned long int j;
+    int rc = 0;
+    int i;
+    for (i = rt->replica_count - 1; i >= 0; i--) {
+        replica_t *replica = &rt->replicas[i];
+        pthread_rwlock_wrlock(&replica->lock);
+        for (j = 0; j < rt->pending_count; j++) {
+            replica_write_t *w = &rt->pending[j];
+            rbtree_node_t *node;
+            if (w->op == RBTREE_REPLICA_DROPPED) {
+                continue;
+            }
+            if (w->op == RBTREE_REPLICA_INSERT) {
+                node = rbtree_insert(replica->tree, w->key);
+                if (node == NULL) {
+                    drop_insert(rt, i, j);
+                    rc = -1;
+                } else {
+                    void *old_data = node->data;
+                    node->data = w->data;
+                    if (i == 0) {
+                        release_replaced(replica->tree, node->key != w->key ? w->key : NULL, old_data != w->data ? old_data : NULL);
+                    }
+                }
+            } else {
+                node = rbtree_lookup(replica->tree, w->key);
+                if (node != NULL) {
+                    rbtree_delete_node(replica->tree, node);
+                }
+            }
+        }
+        pthread_rwlock_unlock(&replica->lock);
+    }
+    rt->pending_count = 0;
+    return rc;
+}
+
+/**
+ * Drop the pending insert j, which failed on replica failed, from the
+ * replicas that already applied it. An insert only fails when it has to
+ * allocate a node, so the key wasn't in any replica before the insert and
+ * those replicas remove it again. That is skipped if a later write to the
+ * same key decides whether it is present anyway. The replicas still to come
+ * skip the write. Called with write_lock held and replica failed locked.
+ */
+static void drop_insert(rbtree_replicated_t *rt, int failed, unsigned long int j) {
+    replica_write_t *w = &rt->pending[j];
+    rbtree_t *tree = rt->replicas[failed].tree;
+    unsigned long int k;
+    int i;
+    w->op = RBTREE_REPLICA_DROPPED;
+    for (k = j + 1; k < rt->pending_count; k++) {
+        if (rt->pending[k].op != RBTREE_REPLICA_DROPPED && tree->cmp_func(rt->pending[k].key, w->key) == 0) {
+            return;
+        }
+    }
+    for (i = failed + 1; i < rt->replica_count; i++) {
+        replica_t *replica = &rt->replicas[i];
+        rbtree_node_t *node;
+        pthread_rwlock_wrlock(&replica->lock);
+        node = rbtree_lookup(replica->tree, w->key);
+        if (node != NULL) {
+            rbtree_delete_node(replica->tree, node);
+        }
+        pthread_rwlock_unlock(&replica->lock);
+    }
+}
+
+static int getcpu_node(void) {
+    unsigned int cpu;
+    unsigned int node;
+#ifdef SYS_getcpu
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+        return (int)node;
+    }
+#endif
+    return 0;
+}
+
+static replica_t *local_replica(rbtree_replicated_t *rt) {
+    int node = rt->current_node();
+    if (node < 0) {
+        node = 0;
+    }
+    return &rt->replicas[node % rt->replica_count];
+}
+
+/**
+ * Read the number of NUMA nodes from sysfs, which lists them as a range such
+ * as "0-1". Returns 1 if that can't be done.
+ */
+static int possible_nodes(void) {
+    FILE *f = fopen("/sys/devices/system/node/possible", "r");
+    int first = 0;
+    int last = 0;
+    int n;
+    if (f == NULL) {
+        return 1;
+    }
+    n = fscanf(f, "%d-%d", &first, &last);
+    fclose(f);
+    if (n < 1) {
+        return 1;
+    }
+    if (n == 1) {
+        last = first;
+    }
+    return last + 1;
+}
+
+static int queue_write(rbtree_replicated_t *rt, int op, void *key, void *data) {
+    int rc = 0;
+    if (rt == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&rt->write_lock);
+    if (rt->pending_count == rt->pending_capacity) {
+        unsigned long int capacity = rt->pending_capacity != 0 ? rt->pending_capacity * 2 : 64;
+        replica_write_t *pending = realloc(rt->pending, capacity * sizeof(replica_write_t));
+        if (pending == NULL) {
+            pthread_mutex_unlock(&rt->write_lock);
+            return -1;
+        }
+        rt->pending = pending;
+        rt->pending_capacity = capacity;
+    }
+    rt->pending[rt->pending_count].op = op;
+    rt->pending[rt->pending_count].key = key;
+    rt->pending[rt->pending_count].data = data;
+    rt->pending_count++;
+    if (rt->pending_count >= RBTREE_REPLICA_BATCH) {
+        rc = apply_pending(rt);
+    }
+    pthread_mutex_unlock(&rt->write_lock);
+    return rc;
+}
+
+/**
+ * Hand a key and data that an insert left out of the tree to the del_func,
+ * on a node made up for the purpose. Either may be NULL, but not both.
+ */
+static void release_replaced(rbtree_t *tree, void *key, void *data) {
+    rbtree_node_t node;
+    if (tree->del_func == NULL || (key == NULL && data == NULL)) {
+        return;
+    }
+    node.parent = node.left = node.right = NULL;
+    node.flags = 0;
+    node.key = key;
+    node.data = data;
+    tree->del_func(&node);
+}
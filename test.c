@@ -1,6 +1,7 @@
 // test.c
 
 #include <fcntl.h> 
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,6 +16,11 @@ typedef struct list_node_t {
     char *key;
 } list_node_t;
 
+typedef struct word_entry_t {
+    char *word;
+    rbtree_node_t node;
+} word_entry_t;
+
 static list_node_t *delete_list = NULL;
 static list_node_t *no_delete_list = NULL;
 static char *words = NULL;
@@ -23,6 +29,14 @@ static rbtree_t *randomized_tree = NULL;
 static rbtree_t *tmp_tree = NULL;
 static rbtree_t *word_tree = NULL;
 static int missing_count = 0;
+static int teardown_count = 0;
+static int expired_count = 0;
+static int change_counts[RBTREE_CHANGE_CLEAR + 1];
+static rbtree_node_t *compact_refs[20000];
+static int relocate_count = 0;
+static int relocate_errors = 0;
+static int fake_node = 0;
+static int owned_free_count = 0;
 static int tmp_count = 0;
 static int word_count = 0;
 static int delete_count = 0;
@@ -30,8 +44,18 @@ static int to_delete_count = 0;
 static char *min = NULL;
 static char *max = NULL;
 
-static int cmp_func_int(void *a, void *b);
 static int load_words(void);
+static void intrusive_teardown_cb(rbtree_node_t *node);
+static void expire_cb(rbtree_node_t *node);
+static int change_cb(int change, void *key, void *data);
+static void relocate_cb(rbtree_node_t *old_node, rbtree_node_t *new_node);
+static int fake_node_cb(void);
+static void owning_del_cb(rbtree_node_t *node);
+static size_t encode_uint64(void *value, void *buf, size_t size);
+static void *decode_uint64(const void *buf, size_t len);
+static uint64_t hash_string(void *key);
+static int trees_match(rbtree_t *a, rbtree_t *b);
+static int check_ranks(rbtree_t *tree, rbtree_node_t *node, int *rank);
 static int del_traversal_cb(rbtree_node_t *node);
 static int tmp_traversal_cb(rbtree_node_t *node);
 static int in_randomized_traversal_cb(rbtree_node_t *node);
@@ -40,7 +64,7 @@ static int in_word_traversal_cb(rbtree_node_t *node);
 int main(int ac, char **av) {
     deleted_tree = rbtree_new((rbtree_key_compare_func_t)strcmp, NULL);
     randomized_tree = rbtree_new((rbtree_key_compare_func_t)strcmp, NULL);
-    tmp_tree = rbtree_new(cmp_func_int, NULL);
+    tmp_tree = rbtree_new(rbtree_key_compare_uint64, NULL);
     word_tree = rbtree_new((rbtree_key_compare_func_t)strcmp, NULL);
     rbtree_node_t *n;
     int rc = 1;
@@ -96,6 +120,14 @@ int main(int ac, char **av) {
     } else {
         printf("ok!\n");
     }
+    printf("checking first/last... ");
+    n = rbtree_first(randomized_tree);
+    rbtree_node_t *m = rbtree_last(randomized_tree);
+    if (n == NULL || m == NULL || strcmp(min, (char *)n->key) != 0 || strcmp(max, (char *)m->key) != 0) {
+        printf("first/last nodes in randomized tree don't match minimum \"%s\" and maximum \"%s\"\n", min, max);
+    } else {
+        printf("ok!\n");
+    }
     printf("checking key retrieval...\n");
     char **keys = rbtree_get_keys(randomized_tree);
     int i = 0;
@@ -109,6 +141,79 @@ int main(int ac, char **av) {
         }
     }
     printf("found %d keys, %d confirmed\n", i, count);
+    printf("checking chunked export... ");
+    fflush(stdout);
+    rbtree_export_token_t token = { NULL, RBTREE_EXPORT_BEGIN };
+    void *chunk_keys[1000];
+    void *chunk_data[1000];
+    unsigned long int chunk;
+    int exported = 0;
+    int mismatch_count = 0;
+    while ((chunk = rbtree_export(randomized_tree, &token, chunk_keys, chunk_data, 1000)) > 0) {
+        for (unsigned long int k = 0; k < chunk; k++) {
+            if (exported >= i || chunk_keys[k] != keys[exported] || chunk_data[k] != rbtree_lookup(randomized_tree, chunk_keys[k])->data) {
+                mismatch_count++;
+            }
+            exported++;
+        }
+    }
+    if (exported != i || mismatch_count != 0 || token.state != RBTREE_EXPORT_END) {
+        printf("exported %d of %d keys, %d out of order\n", exported, i, mismatch_count);
+    } else {
+        printf("ok!\n");
+    }
+    free(keys);
+    printf("compacting randomized tree... ");
+    fflush(stdout);
+    rbtree_compact_stats_t stats;
+    if (rbtree_compact(randomized_tree, NULL, &stats) != 0 || stats.nodes_moved != randomized_tree->node_count) {
+        printf("compaction failed after moving %li nodes\n", stats.nodes_moved);
+    } else {
+        printf("ok!\n");
+        printf("moved %li nodes, mean link distance %.0f -> %.0f bytes\n", stats.nodes_moved, stats.link_distance_before, stats.link_distance_after);
+    }
+    printf("checking incremental compaction... ");
+    fflush(stdout);
+    rbtree_t *compact_tree = rbtree_new(rbtree_key_compare_uint64, NULL);
+    if (compact_tree == NULL) {
+        fprintf(stderr, "error allocating tree structure\n");
+        goto end;
+    }
+    for (uint64_t t = 0; t < 20000; t += 2) {
+        compact_refs[t] = rbtree_insert(compact_tree, (void *)t);
+    }
+    // The tree changes between steps, and the application's node pointers
+    // are kept up to date only through the relocation callback.
+    unsigned long int steps = 0;
+    unsigned long int moved = 0;
+    int step_rc;
+    do {
+        step_rc = rbtree_compact_step(compact_tree, 64, relocate_cb, &stats);
+        moved += stats.nodes_moved;
+        uint64_t t = steps * 2 + 1;
+        if (t < 20000) {
+            compact_refs[t] = rbtree_insert(compact_tree, (void *)t);
+        }
+        t = steps * 4;
+        if (t < 20000 && compact_refs[t] != NULL) {
+            rbtree_delete_node(compact_tree, compact_refs[t]);
+            compact_refs[t] = NULL;
+        }
+        steps++;
+    } while (step_rc == 1);
+    missing_count = 0;
+    for (uint64_t t = 0; t < 20000; t++) {
+        if (compact_refs[t] != rbtree_lookup(compact_tree, (void *)t)) {
+            missing_count++;
+        }
+    }
+    if (step_rc != 0 || missing_count != 0 || relocate_errors != 0 || relocate_count == 0 || (unsigned long int)relocate_count != moved) {
+        printf("%i stale node pointers, %i bad relocations, %i relocations for %li moves\n", missing_count, relocate_errors, relocate_count, moved);
+    } else {
+        printf("ok!\n");
+        printf("moved %li nodes in %li steps\n", moved, steps);
+    }
+    rbtree_free(compact_tree);
     printf("%i nodes to delete...\n", to_delete_count);
     printf("deleting approximately half of words in randomized tree...");
     fflush(stdout);
@@ -147,6 +252,528 @@ int main(int ac, char **av) {
         l = l->next;
     }
     printf("%i nodes improperly deleted\n", delete_count);
+    printf("checking lazy deletion... ");
+    fflush(stdout);
+    rbtree_set_lazy_delete(deleted_tree, 100);
+    int live_count = 0;
+    for (l = no_delete_list; l != NULL; l = l->next) {
+        rbtree_insert(deleted_tree, l->key);
+        live_count++;
+    }
+    for (l = delete_list; l != NULL; l = l->next) {
+        rbtree_insert(deleted_tree, l->key);
+    }
+    delete_count = 0;
+    for (l = delete_list; l != NULL; l = l->next) {
+        n = rbtree_lookup(deleted_tree, l->key);
+        if (n == NULL) {
+            delete_count++;
+            continue;
+        }
+        rbtree_delete_node(deleted_tree, n);
+    }
+    for (l = delete_list; l != NULL; l = l->next) {
+        if (rbtree_lookup(deleted_tree, l->key) != NULL) {
+            delete_count++;
+        }
+    }
+    for (l = no_delete_list; l != NULL; l = l->next) {
+        if (rbtree_lookup(deleted_tree, l->key) == NULL) {
+            delete_count++;
+        }
+    }
+    if (delete_list != NULL) {
+        n = rbtree_insert(deleted_tree, delete_list->key);
+        if (n == NULL || rbtree_lookup(deleted_tree, delete_list->key) != n) {
+            delete_count++;
+        }
+        live_count++;
+    }
+    rbtree_purge(deleted_tree);
+    if (delete_count != 0 || deleted_tree->node_count != live_count || deleted_tree->tombstone_count != 0) {
+        printf("%i lookups wrong, %li nodes in tree, %i expected\n", delete_count, deleted_tree->node_count, live_count);
+    } else {
+        printf("ok!\n");
+    }
+    printf("checking lazy deletion from the front... ");
+    fflush(stdout);
+    // Used as a scheduler, the tree repeatedly gives up its first node.
+    // Tombstones left in the middle must not pile up at the front.
+    rbtree_t *front_tree = rbtree_new(rbtree_key_compare_uint64, NULL);
+    if (front_tree == NULL) {
+        fprintf(stderr, "error allocating tree structure\n");
+        goto end;
+    }
+    rbtree_set_lazy_delete(front_tree, 50);
+    for (uint64_t t = 0; t < 200000; t++) {
+        rbtree_insert(front_tree, (void *)t);
+    }
+    for (uint64_t t = 1; t < 200000; t += 3) {
+        rbtree_delete_node(front_tree, rbtree_lookup(front_tree, (void *)t));
+    }
+    delete_count = 0;
+    uint64_t expected = 0;
+    for (i = 0; i < 90000; i++) {
+        n = rbtree_first(front_tree);
+        if (n == NULL || (uint64_t)n->key != expected || RBTREE_IS_TOMBSTONE(rbtree_last(front_tree)) || front_tree->tombstone_count > 66667) {
+            delete_count++;
+            break;
+        }
+        rbtree_delete_node(front_tree, n);
+        expected += expected % 3 == 0 ? 2 : 1;
+    }
+    if (delete_count != 0 || front_tree->node_count != 200000 - 66667 - 90000) {
+        printf("wrong first node after %i deletions, %li nodes in tree\n", i, front_tree->node_count);
+    } else {
+        printf("ok!\n");
+    }
+    rbtree_free(front_tree);
+    printf("checking intrusive tree... ");
+    fflush(stdout);
+    rbtree_t *intrusive_tree = rbtree_new_intrusive((rbtree_key_compare_func_t)strcmp, intrusive_teardown_cb);
+    word_entry_t *entries = calloc(word_count, sizeof(word_entry_t));
+    if (intrusive_tree == NULL || entries == NULL) {
+        fprintf(stderr, "error allocating intrusive tree\n");
+        goto end;
+    }
+    i = 0;
+    for (l = no_delete_list; l != NULL; l = l->next) {
+        entries[i].word = l->key;
+        entries[i].node.key = l->key;
+        rbtree_link(intrusive_tree, &entries[i++].node);
+    }
+    for (l = delete_list; l != NULL; l = l->next) {
+        entries[i].word = l->key;
+        entries[i].node.key = l->key;
+        rbtree_link(intrusive_tree, &entries[i++].node);
+    }
+    missing_count = 0;
+    for (l = delete_list; l != NULL; l = l->next) {
+        n = rbtree_lookup(intrusive_tree, l->key);
+        if (n == NULL || RBTREE_ENTRY(n, word_entry_t, node)->word != l->key) {
+            missing_count++;
+        } else {
+            rbtree_unlink(intrusive_tree, n);
+        }
+    }
+    // A tree that owns its nodes must not accept an embedded one, which it
+    // would later free.
+    word_entry_t stray = { .word = "not a word", .node = { .key = "not a word" } };
+    if (rbtree_link(word_tree, &stray.node) != NULL || rbtree_lookup(word_tree, "not a word") != NULL) {
+        missing_count++;
+    }
+    count = intrusive_tree->node_count;
+    rbtree_free(intrusive_tree);
+    free(entries);
+    if (missing_count != 0 || teardown_count != count) {
+        printf("%i entries not found, %i of %i entries torn down\n", missing_count, teardown_count, count);
+    } else {
+        printf("ok!\n");
+    }
+    printf("checking expiry... ");
+    fflush(stdout);
+    rbtree_t *expiry_tree = rbtree_new(rbtree_key_compare_uint64, NULL);
+    if (expiry_tree == NULL) {
+        fprintf(stderr, "error allocating expiry tree\n");
+        goto end;
+    }
+    for (uint64_t t = 0; t < word_count; t++) {
+        rbtree_insert(expiry_tree, (void *)t);
+    }
+    rbtree_detached_t *expired = rbtree_expire_before(expiry_tree, (void *)(uint64_t)(word_count / 2), expire_cb);
+    count = expired != NULL ? expired->node_count : 0;
+    while (rbtree_reclaim_step(expired, 4096) > 0) {
+    }
+    n = rbtree_first(expiry_tree);
+    if (count != word_count / 2 || expired_count != count || expiry_tree->node_count != word_count - count || n == NULL || (uint64_t)n->key != word_count / 2) {
+        printf("%i of %i nodes expired, %li left in tree\n", expired_count, word_count / 2, expiry_tree->node_count);
+    } else {
+        printf("ok!\n");
+    }
+    printf("checking detach all... ");
+    fflush(stdout);
+    count = expiry_tree->node_count;
+    expired = rbtree_detach_all(expiry_tree);
+    if (expired == NULL || expired->node_count != count || expiry_tree->node_count != 0 || rbtree_first(expiry_tree) != NULL) {
+        printf("%li nodes left in tree\n", expiry_tree->node_count);
+    } else {
+        rbtree_insert(expiry_tree, (void *)(uint64_t)word_count);
+        while (rbtree_reclaim_step(expired, 4096) > 0) {
+        }
+        if (expiry_tree->node_count != 1 || rbtree_first(expiry_tree) != rbtree_last(expiry_tree)) {
+            printf("tree not reusable after detach\n");
+        } else {
+            printf("ok!\n");
+        }
+    }
+    rbtree_free(expiry_tree);
+    printf("checking journal recovery... ");
+    fflush(stdout);
+    unlink("journal.ckpt");
+    unlink("journal.log");
+    rbtree_codec_t codec = { encode_uint64, decode_uint64, encode_uint64, decode_uint64 };
+    rbtree_t *journal_tree = rbtree_new(rbtree_key_compare_uint64, NULL);
+    rbtree_t *recovered_tree = rbtree_new(rbtree_key_compare_uint64, NULL);
+    if (journal_tree == NULL || recovered_tree == NULL || rbtree_journal_open(journal_tree, "journal", &codec) != 0) {
+        fprintf(stderr, "error opening journal\n");
+        goto end;
+    }
+    for (uint64_t t = 0; t < 10000; t++) {
+        rbtree_set_data(journal_tree, rbtree_insert(journal_tree, (void *)t), (void *)(t * 3));
+    }
+    rbtree_checkpoint(journal_tree);
+    for (uint64_t t = 0; t < 10000; t += 3) {
+        rbtree_delete_node(journal_tree, rbtree_lookup(journal_tree, (void *)t));
+    }
+    for (uint64_t t = 1; t < 10000; t += 7) {
+        n = rbtree_lookup(journal_tree, (void *)t);
+        if (n != NULL) {
+            rbtree_set_data(journal_tree, n, (void *)(t + 1));
+        }
+    }
+    rbtree_checkpoint(journal_tree);
+    rbtree_pop_max(journal_tree, NULL, NULL);
+    rbtree_reclaim_step(rbtree_expire_before(journal_tree, (void *)(uint64_t)100, NULL), ULONG_MAX);
+    rbtree_insert(journal_tree, (void *)(uint64_t)50);
+    rc = rbtree_journal_close(journal_tree);
+    if (rc == 0) {
+        rc = rbtree_journal_open(recovered_tree, "journal", &codec);
+    }
+    if (rc == 0 && trees_match(journal_tree, recovered_tree)) {
+        rc = rbtree_checkpoint(recovered_tree);
+        rbtree_free(recovered_tree);
+        recovered_tree = rbtree_new(rbtree_key_compare_uint64, NULL);
+        rc |= rbtree_journal_open(recovered_tree, "journal", &codec);
+    }
+    if (rc != 0 || !trees_match(journal_tree, recovered_tree)) {
+        printf("recovered tree has %li nodes, %li expected\n", recovered_tree->node_count, journal_tree->node_count);
+    } else {
+        printf("ok!\n");
+    }
+    printf("checking torn journal header... ");
+    fflush(stdout);
+    // A header cut short by a crash can claim any length. Replay must stop
+    // there instead of trying to allocate and read gigabytes.
+    rbtree_free(recovered_tree);
+    unsigned char torn[13] = { 0, 0, 0, 0, 1, 0xf0, 0xff, 0xff, 0xff, 0xf0, 0xff, 0xff, 0xff };
+    int torn_fd = open("journal.log", O_WRONLY | O_APPEND | O_CREAT, 0644);
+    rc = torn_fd >= 0 && write(torn_fd, torn, sizeof(torn)) == sizeof(torn) ? 0 : -1;
+    if (torn_fd >= 0) {
+        close(torn_fd);
+    }
+    recovered_tree = rbtree_new(rbtree_key_compare_uint64, NULL);
+    if (rc == 0) {
+        rc = rbtree_journal_open(recovered_tree, "journal", &codec);
+    }
+    if (rc != 0 || !trees_match(journal_tree, recovered_tree)) {
+        printf("recovered tree has %li nodes, %li expected\n", recovered_tree->node_count, journal_tree->node_count);
+    } else {
+        printf("ok!\n");
+    }
+    rc = 1;
+    rbtree_free(journal_tree);
+    rbtree_free(recovered_tree);
+    unlink("journal.ckpt");
+    unlink("journal.log");
+    printf("checking replicated tree... ");
+    fflush(stdout);
+    rbtree_topology_t topology = { 2, fake_node_cb };
+    rbtree_replicated_t *replicated_tree = rbtree_replicated_new((rbtree_key_compare_func_t)strcmp, NULL, &topology);
+    if (replicated_tree == NULL) {
+        fprintf(stderr, "error allocating replicated tree\n");
+        goto end;
+    }
+    for (l = no_delete_list; l != NULL; l = l->next) {
+        rbtree_replicated_insert(replicated_tree, l->key, l->key);
+    }
+    for (l = delete_list; l != NULL; l = l->next) {
+        rbtree_replicated_insert(replicated_tree, l->key, l->key);
+    }
+    rbtree_replicated_commit(replicated_tree);
+    for (l = delete_list; l != NULL; l = l->next) {
+        rbtree_replicated_delete(replicated_tree, l->key);
+    }
+    rbtree_replicated_commit(replicated_tree);
+    missing_count = 0;
+    for (fake_node = 0; fake_node < topology.node_count; fake_node++) {
+        void *data;
+        for (l = no_delete_list; l != NULL; l = l->next) {
+            if (rbtree_replicated_lookup(replicated_tree, l->key, &data) != 0 || data != l->key) {
+                missing_count++;
+            }
+        }
+        for (l = delete_list; l != NULL; l = l->next) {
+            if (rbtree_replicated_lookup(replicated_tree, l->key, NULL) == 0) {
+                missing_count++;
+            }
+        }
+    }
+    rbtree_t *replica = rbtree_replicated_acquire(replicated_tree);
+    count = replica->node_count;
+    rbtree_replicated_release(replicated_tree, replica);
+    if (missing_count != 0 || count != word_count - to_delete_count) {
+        printf("%i lookups wrong, %i nodes in replica\n", missing_count, count);
+    } else {
+        printf("ok!\n");
+    }
+    printf("checking replicated insert failure... ");
+    fflush(stdout);
+    // Replica 0 is written last. Making it look full makes its next node
+    // allocation fail after replica 1 succeeded.
+    fake_node = 0;
+    replica = rbtree_replicated_acquire(replicated_tree);
+    rbtree_replicated_release(replicated_tree, replica);
+    count = replica->node_count;
+    replica->node_count = UINT32_MAX;
+    rbtree_replicated_insert(replicated_tree, "not a word", "not a word");
+    rbtree_replicated_insert(replicated_tree, no_delete_list->key, "replaced");
+    int commit_rc = rbtree_replicated_commit(replicated_tree);
+    replica->node_count = count;
+    missing_count = 0;
+    for (fake_node = 0; fake_node < topology.node_count; fake_node++) {
+        void *data = NULL;
+        if (rbtree_replicated_lookup(replicated_tree, "not a word", NULL) == 0) {
+            missing_count++;
+        }
+        if (rbtree_replicated_lookup(replicated_tree, no_delete_list->key, &data) != 0 || strcmp(data, "replaced") != 0) {
+            missing_count++;
+        }
+    }
+    rbtree_replicated_free(replicated_tree);
+    if (commit_rc != -1 || missing_count != 0) {
+        printf("commit returned %i, %i replica lookups wrong\n", commit_rc, missing_count);
+    } else {
+        printf("ok!\n");
+    }
+    printf("checking replicated update with an owning del_func... ");
+    fflush(stdout);
+    // Updating a key queues a second copy of the key and replaces the data.
+    // Both must reach the del_func exactly once, and nothing else may.
+    replicated_tree = rbtree_replicated_new((rbtree_key_compare_func_t)strcmp, owning_del_cb, &topology);
+    if (replicated_tree == NULL) {
+        fprintf(stderr, "error allocating replicated tree\n");
+        goto end;
+    }
+    rbtree_replicated_insert(replicated_tree, strdup("alpha"), strdup("one"));
+    rbtree_replicated_commit(replicated_tree);
+    rbtree_replicated_insert(replicated_tree, strdup("alpha"), strdup("two"));
+    rbtree_replicated_commit(replicated_tree);
+    count = owned_free_count;
+    missing_count = 0;
+    for (fake_node = 0; fake_node < topology.node_count; fake_node++) {
+        void *data = NULL;
+        if (rbtree_replicated_lookup(replicated_tree, "alpha", &data) != 0 || strcmp(data, "two") != 0) {
+            missing_count++;
+        }
+    }
+    rbtree_replicated_free(replicated_tree);
+    if (missing_count != 0 || count != 2 || owned_free_count != 4) {
+        printf("%i lookups wrong, %i pointers freed by the update, %i in all\n", missing_count, count, owned_free_count);
+    } else {
+        printf("ok!\n");
+    }
+    printf("checking binding to a missing NUMA node... ");
+    fflush(stdout);
+    rbtree_t *numa_tree = rbtree_new(rbtree_key_compare_uint64, NULL);
+    if (numa_tree == NULL) {
+        fprintf(stderr, "error allocating tree structure\n");
+        goto end;
+    }
+    if (rbtree_set_numa_node(numa_tree, 4096) == 0 || numa_tree->numa_node != -1 || rbtree_insert(numa_tree, (void *)1) == NULL) {
+        printf("binding failure not reported\n");
+    } else {
+        printf("ok!\n");
+    }
+    rbtree_free(numa_tree);
+    printf("checking lookup cache... ");
+    fflush(stdout);
+    if (rbtree_set_lookup_cache(randomized_tree, 256, hash_string) != 0) {
+        fprintf(stderr, "error allocating lookup cache\n");
+        goto end;
+    }
+    missing_count = 0;
+    for (int round = 0; round < 1000; round++) {
+        if (round == 500) {
+            rbtree_compact(randomized_tree, NULL, NULL);
+        }
+        i = 0;
+        for (l = no_delete_list; l != NULL && i < 64; l = l->next, i++) {
+            n = rbtree_lookup(randomized_tree, l->key);
+            if (n == NULL || strcmp(n->key, l->key) != 0) {
+                missing_count++;
+            }
+        }
+    }
+    unsigned long int hits = randomized_tree->cache_hits;
+    i = 0;
+    for (l = no_delete_list; l != NULL && i < 8; l = l->next, i++) {
+        rbtree_delete_node(randomized_tree, rbtree_lookup(randomized_tree, l->key));
+        if (rbtree_lookup(randomized_tree, l->key) != NULL) {
+            missing_count++;
+        }
+    }
+    if (missing_count != 0 || hits * 10 < (hits + randomized_tree->cache_misses) * 9) {
+        printf("%i lookups wrong, %li hits, %li misses\n", missing_count, hits, randomized_tree->cache_misses);
+    } else {
+        printf("ok!\n");
+        printf("%li hits, %li misses\n", hits, randomized_tree->cache_misses);
+    }
+    printf("checking lookup cache with copied keys... ");
+    fflush(stdout);
+    // Looking up an equal key at another address must still let deletion
+    // find the cached node. Pointer hashing can't, so it is refused.
+    rbtree_t *copy_tree = rbtree_new((rbtree_key_compare_func_t)strcmp, NULL);
+    if (copy_tree == NULL) {
+        fprintf(stderr, "error allocating tree structure\n");
+        goto end;
+    }
+    char hello[] = "hello";
+    char *hello_key = strdup(hello);
+    missing_count = 0;
+    if (rbtree_set_lookup_cache(copy_tree, 16, NULL) != -1) {
+        missing_count++;
+    }
+    if (hello_key == NULL || rbtree_set_lookup_cache(copy_tree, 16, hash_string) != 0) {
+        fprintf(stderr, "error allocating lookup cache\n");
+        goto end;
+    }
+    rbtree_insert(copy_tree, hello_key);
+    n = rbtree_lookup(copy_tree, hello);
+    if (n == NULL) {
+        missing_count++;
+    } else {
+        rbtree_delete_node(copy_tree, n);
+    }
+    free(hello_key);
+    if (rbtree_lookup(copy_tree, hello) != NULL) {
+        missing_count++;
+    }
+    rbtree_free(copy_tree);
+    if (missing_count != 0) {
+        printf("%i lookups wrong\n", missing_count);
+    } else {
+        printf("ok!\n");
+    }
+    const char *policy_names[] = { "RB", "WAVL", "AVL" };
+    for (int policy = RBTREE_POLICY_RB; policy <= RBTREE_POLICY_AVL; policy++) {
+        printf("checking %s balancing... ", policy_names[policy]);
+        fflush(stdout);
+        rbtree_t *policy_tree = rbtree_new_with_policy((rbtree_key_compare_func_t)strcmp, NULL, policy);
+        if (policy_tree == NULL) {
+            fprintf(stderr, "error allocating tree structure\n");
+            goto end;
+        }
+        unsigned long int ops = 0;
+        for (l = delete_list; l != NULL; l = l->next, ops++) {
+            rbtree_insert(policy_tree, l->key);
+        }
+        for (l = no_delete_list; l != NULL; l = l->next, ops++) {
+            rbtree_insert(policy_tree, l->key);
+        }
+        for (l = delete_list; l != NULL; l = l->next, ops++) {
+            rbtree_delete_node(policy_tree, rbtree_lookup(policy_tree, l->key));
+        }
+        missing_count = 0;
+        for (l = delete_list; l != NULL; l = l->next) {
+            if (rbtree_lookup(policy_tree, l->key) != NULL) {
+                missing_count++;
+            }
+        }
+        for (l = no_delete_list; l != NULL; l = l->next) {
+            if (rbtree_lookup(policy_tree, l->key) == NULL) {
+                missing_count++;
+            }
+        }
+        count = policy_tree->node_count;
+        int rank;
+        int rank_errors = policy != RBTREE_POLICY_RB ? check_ranks(policy_tree, policy_tree->root, &rank) : 0;
+        // Mix in the other ways of removing nodes, including tombstones and
+        // the purge that clears them, then check the ranks again.
+        for (int k = 0; k < 100; k++, ops += 2) {
+            rbtree_pop_min(policy_tree, NULL, NULL);
+            rbtree_pop_max(policy_tree, NULL, NULL);
+        }
+        rbtree_set_lazy_delete(policy_tree, 5);
+        int k = 0;
+        for (l = no_delete_list; l != NULL; l = l->next, k++) {
+            n = k % 3 == 0 ? rbtree_lookup(policy_tree, l->key) : NULL;
+            if (n != NULL) {
+                rbtree_delete_node(policy_tree, n);
+                ops++;
+            }
+        }
+        for (l = delete_list; l != NULL; l = l->next, ops++) {
+            rbtree_insert(policy_tree, l->key);
+        }
+        rbtree_set_lazy_delete(policy_tree, 0);
+        if (policy != RBTREE_POLICY_RB) {
+            rank_errors += check_ranks(policy_tree, policy_tree->root, &rank);
+        }
+        if (missing_count != 0 || count != word_count - to_delete_count || rank_errors != 0 || policy_tree->tombstone_count != 0) {
+            printf("%i lookups wrong, %i nodes in tree, %i rank errors\n", missing_count, count, rank_errors);
+        } else {
+            printf("ok!\n");
+            printf("%.2f rotations per op, height %i\n", (double)policy_tree->rotations / ops, rbtree_height(policy_tree));
+        }
+        rbtree_free(policy_tree);
+    }
+    if (rbtree_new_with_policy((rbtree_key_compare_func_t)strcmp, NULL, -1) != NULL) {
+        printf("tree created with an unknown policy\n");
+    }
+    printf("checking change feed... ");
+    fflush(stdout);
+    rbtree_t *feed_tree = rbtree_new(rbtree_key_compare_uint64, NULL);
+    if (feed_tree == NULL || rbtree_set_change_feed(feed_tree, 1024, NULL, NULL) != 0) {
+        fprintf(stderr, "error allocating tree structure\n");
+        goto end;
+    }
+    if (rbtree_set_change_feed(randomized_tree, 1024, NULL, NULL) != -1) {
+        printf("change feed added to a tree with nodes\n");
+    }
+    for (uint64_t t = 0; t < 10000; t++) {
+        rbtree_insert(feed_tree, (void *)t);
+    }
+    uint64_t version = feed_tree->version;
+    for (uint64_t t = 0; t < 10000; t += 10) {
+        rbtree_delete_node(feed_tree, rbtree_lookup(feed_tree, (void *)t));
+        rbtree_set_data(feed_tree, rbtree_lookup(feed_tree, (void *)(t + 5)), (void *)t);
+    }
+    for (uint64_t t = 10000; t < 10100; t++) {
+        rbtree_insert(feed_tree, (void *)t);
+    }
+    rbtree_reclaim_step(rbtree_expire_before(feed_tree, (void *)(uint64_t)100, NULL), ULONG_MAX);
+    int feed_rc = rbtree_changes_since(feed_tree, version, change_cb);
+    if (feed_rc != 0 || change_counts[RBTREE_CHANGE_DELETE] != 1000 || change_counts[RBTREE_CHANGE_EXPIRE] != 1 || change_counts[RBTREE_CHANGE_UPSERT] != 1090) {
+        printf("%i deletes, %i expiries and %i upserts reported\n", change_counts[RBTREE_CHANGE_DELETE], change_counts[RBTREE_CHANGE_EXPIRE], change_counts[RBTREE_CHANGE_UPSERT]);
+    } else {
+        for (uint64_t t = 1001; t < 10000; t += 10) {
+            rbtree_delete_node(feed_tree, rbtree_lookup(feed_tree, (void *)t));
+        }
+        if (rbtree_changes_since(feed_tree, version, change_cb) != -1) {
+            printf("changes reported after the feed overflowed\n");
+        } else {
+            printf("ok!\n");
+        }
+    }
+    rbtree_free(feed_tree);
+    printf("popping remaining nodes from randomized tree in ascending order... ");
+    fflush(stdout);
+    unsigned long int remaining = randomized_tree->node_count;
+    char *prev = NULL;
+    char *key;
+    delete_count = 0;
+    while (rbtree_pop_min(randomized_tree, (void **)&key, NULL) == 0) {
+        if (prev != NULL && strcmp(prev, key) >= 0) {
+            printf("\"%s\" popped after \"%s\"\n", key, prev);
+        }
+        prev = key;
+        delete_count++;
+    }
+    if (delete_count != remaining || randomized_tree->node_count != 0 || rbtree_first(randomized_tree) != NULL) {
+        printf("popped %i of %li nodes\n", delete_count, remaining);
+    } else {
+        printf("ok!\n");
+    }
     rc = 0;
 end:
     if (no_delete_list != NULL) {
@@ -185,13 +812,60 @@ end:
     return(rc);
 }
 
-static int cmp_func_int(void *a, void *b) {
-    if ((uint64_t)a < (uint64_t)b) {
-        return(-1);
-    } else if ((uint64_t)a == (uint64_t)b) {
-        return(0);
-    } else {
-        return(1);
+static void expire_cb(rbtree_node_t *node) {
+    expired_count++;
+}
+
+static int change_cb(int change, void *key, void *data) {
+    change_counts[change]++;
+    return 0;
+}
+
+static void relocate_cb(rbtree_node_t *old_node, rbtree_node_t *new_node) {
+    uint64_t key = (uint64_t)new_node->key;
+    if (old_node->key != new_node->key || compact_refs[key] != old_node) {
+        relocate_errors++;
+    }
+    compact_refs[key] = new_node;
+    relocate_count++;
+}
+
+static void *decode_uint64(const void *buf, size_t len) {
+    uint64_t value = 0;
+    memcpy(&value, buf, len < sizeof(value) ? len : sizeof(value));
+    return (void *)value;
+}
+
+static size_t encode_uint64(void *value, void *buf, size_t size) {
+    if (size >= sizeof(uint64_t)) {
+        memcpy(buf, &value, sizeof(uint64_t));
+    }
+    return sizeof(uint64_t);
+}
+
+static uint64_t hash_string(void *key) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char *p = key; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int fake_node_cb(void) {
+    return fake_node;
+}
+
+static void owning_del_cb(rbtree_node_t *node) {
+    owned_free_count += (node->key != NULL) + (node->data != NULL);
+    free(node->key);
+    free(node->data);
+}
+
+static void intrusive_teardown_cb(rbtree_node_t *node) {
+    word_entry_t *entry = RBTREE_ENTRY(node, word_entry_t, node);
+    if (entry->word == node->key) {
+        teardown_count++;
     }
 }
 
@@ -303,4 +977,64 @@ static int load_words(void) {
 cleanup:
     close(fd);
     return(rc);
-}
\ No newline at end of file
+}
+
+static int trees_match(rbtree_t *a, rbtree_t *b) {
+    rbtree_export_token_t ta = { NULL, RBTREE_EXPORT_BEGIN };
+    rbtree_export_token_t tb = { NULL, RBTREE_EXPORT_BEGIN };
+    void *keys_a[256];
+    void *keys_b[256];
+    void *data_a[256];
+    void *data_b[256];
+    unsigned long int n;
+    if (a->node_count != b->node_count) {
+        return 0;
+    }
+    while ((n = rbtree_export(a, &ta, keys_a, data_a, 256)) > 0) {
+        if (rbtree_export(b, &tb, keys_b, data_b, 256) != n || memcmp(keys_a, keys_b, n * sizeof(void *)) != 0 || memcmp(data_a, data_b, n * sizeof(void *)) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Rebuild the ranks of a WAVL or AVL subtree from the parity bits and count
+ * the nodes that break the rank rules. Both children must agree on the rank
+ * of their parent, which keeps every rank difference at 1 or 2, leaves must
+ * have rank 0, and AVL nodes can't have two children of rank difference 2.
+ * Parent links are checked on the way.
+ */
+static int check_ranks(rbtree_t *tree, rbtree_node_t *node, int *rank) {
+    rbtree_node_t *nil = &tree->nil_node;
+    int left_rank;
+    int right_rank;
+    int left_diff;
+    int right_diff;
+    int errors = 0;
+    if (node == nil) {
+        *rank = -1;
+        return 0;
+    }
+    if ((node->left != nil && node->left->parent != node) || (node->right != nil && node->right->parent != node)) {
+        errors++;
+    }
+    if (node == tree->root && node->parent != nil) {
+        errors++;
+    }
+    errors += check_ranks(tree, node->left, &left_rank);
+    errors += check_ranks(tree, node->right, &right_rank);
+    left_diff = ((node->left->flags ^ node->flags) & RBTREE_COLOR_MASK) ? 1 : 2;
+    right_diff = ((node->right->flags ^ node->flags) & RBTREE_COLOR_MASK) ? 1 : 2;
+    *rank = left_rank + left_diff;
+    if (right_rank + right_diff != *rank) {
+        errors++;
+    }
+    if (node->left == nil && node->right == nil && *rank != 0) {
+        errors++;
+    }
+    if (tree->policy == RBTREE_POLICY_AVL && left_diff == 2 && right_diff == 2) {
+        errors++;
+    }
+    return errors;
+}